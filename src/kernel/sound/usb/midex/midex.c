@@ -21,6 +21,7 @@
 #include <linux/types.h>
 #include <linux/init.h>
 #include <linux/slab.h>
+#include <linux/cache.h>
 #include <linux/module.h>
 #include <linux/bitmap.h>
 
@@ -33,14 +34,30 @@
 #include <linux/ihex.h>
 
 #include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/kfifo.h>
 #include <linux/ktime.h>
 #include <linux/timer.h>
 #include <linux/hrtimer.h>
 
 #include <sound/core.h>
+#include <sound/control.h>
+#include <sound/hwdep.h>
+#include <sound/info.h>
 #include <sound/initval.h>
 #include <sound/rawmidi.h>
 #include <sound/asound.h>
+#if IS_ENABLED(CONFIG_SND_SEQUENCER)
+#include <sound/asequencer.h>
+#include <sound/seq_kernel.h>
+#endif
+#if IS_ENABLED(CONFIG_SND_UMP) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define SB_MIDEX_HAVE_UMP
+#include <sound/ump.h>
+#endif
+#include "midex_ioctl.h"
 
 /*******************************************************************
  * Defines
@@ -48,13 +65,149 @@
 #define SB_MIDEX_PREFIX "snd-usb-midex: "
 
 #define SB_MIDEX_URB_BUFFER_SIZE 64
+/*
+ * EP6 out: up to 8 LED commands per transfer, as wMaxPacketSize allows
+ * (with led_batch, else one)
+ */
+#define SB_MIDEX_LED_BUFFER_SIZE 32
+#define SB_MIDEX_LED_REPLY_BUFFER_SIZE 8
 #define SB_MIDEX_NUM_URBS_PER_EP 7
 
+/*
+ * The MIDI input urb pool sizes itself between these limits: it grows when
+ * urbs complete back-to-back with full buffers, and shrinks after
+ * SB_MIDEX_NUM_IN_URBS_IDLE_TICKS timing periods (25.6ms) without.
+ */
+#define SB_MIDEX_NUM_IN_URBS_MIN 3
+#define SB_MIDEX_NUM_IN_URBS_MAX 16
+#define SB_MIDEX_NUM_IN_URBS_IDLE_TICKS 40
+
+/*
+ * An output port may fill 1/SB_MIDEX_OUT_PORT_SHARE of an urb, so the other
+ * ports get their share of it. Ports take turns, a run of bytes each.
+ */
+#define SB_MIDEX_OUT_PORT_SHARE 2
+
+/*
+ * Output pacing: a DIN port sends a byte per 320us (31.25 kbaud, 10 bits).
+ * A port gets no more packets once the device would need more than
+ * SB_MIDEX_OUT_PACE_AHEAD_NS to put what it got on the wire.
+ */
+#define SB_MIDEX_DIN_BYTE_NS 320000
+#define SB_MIDEX_OUT_PACE_AHEAD_NS (32 * SB_MIDEX_DIN_BYTE_NS)
+
+/*
+ * Packets of in-kernel sources for a port wait while its substream is in a
+ * SysEx, but not longer than this after the substream last sent bytes, so a
+ * stalled client does not hold them up.
+ */
+#define SB_MIDEX_OUT_SYSEX_HOLD_NS (20 * NSEC_PER_MSEC)
+
+/* Scheduled events later than this are counted as late */
+#define SB_MIDEX_SCHED_LATE_NS NSEC_PER_MSEC
+
+/* MIDI clock generator tempo range and default, in 1/100 BPM */
+#define SB_MIDEX_CLOCK_GEN_TEMPO_MIN 2000
+#define SB_MIDEX_CLOCK_GEN_TEMPO_MAX 30000
+#define SB_MIDEX_CLOCK_GEN_TEMPO_DEFAULT 12000
+
+/* Drain waits this long on top of the DIN line time of the urbs in flight */
+#define SB_MIDEX_DRAIN_MARGIN_MS 50
+
 /* Timer periods (in ms) */
 #define TIMER_PERIOD_TIMING_NS (25600 * 1000)
 
-#define TIMER_PERIOD_LED_INACTIVE_MS 50
-#define TIMER_PERIOD_LED_ACTIVE_MS 150
+/*
+ * URB health monitor: an endpoint whose oldest urb made no progress for its
+ * limit is recovered. That is SB_MIDEX_URB_STUCK_NS for EP2 and EP6 out, and
+ * for EP4 out SB_MIDEX_URB_STUCK_OUT_NS on top of the DIN line time still
+ * queued for the busiest port, as the device holds output back (NAKs) while
+ * its lines catch up. The monitor looks every SB_MIDEX_URB_MONITOR_NS while
+ * urbs are in flight, and leaves an endpoint alone after
+ * SB_MIDEX_URB_MAX_RECOVERIES recoveries without a completed transfer.
+ * The limits are a few frames above what a working device takes to accept
+ * an interrupt transfer; a stall (-EPIPE) is recovered right away.
+ */
+#define SB_MIDEX_URB_MONITOR_NS (2 * NSEC_PER_MSEC)
+#define SB_MIDEX_URB_STUCK_NS (10 * NSEC_PER_MSEC)
+#define SB_MIDEX_URB_STUCK_OUT_NS (10 * NSEC_PER_MSEC)
+#define SB_MIDEX_URB_MAX_RECOVERIES 3
+
+/* sb_midex.urb_flags */
+#define SB_MIDEX_URB_MONITOR_ARMED 0
+#define SB_MIDEX_URB_GONE 1 /* disconnected: no monitoring, recovery, output */
+
+/*
+ * The LED work runs from the timing timer, every 2 timing periods (~50ms):
+ * the start up graphics, then the activity LEDs, and every third time the
+ * keepalive while in use (~150ms).
+ */
+#define TIMER_TICKS_LED 2
+#define SB_MIDEX_LED_KEEPALIVE_RUNS 3
+
+/* Sides of a port LED ([40 LL ff SS]) used for input and output activity */
+#define SB_MIDEX_LED_IN 0x02 /* left */
+#define SB_MIDEX_LED_OUT 0x01 /* right */
+
+/*
+ * MIDEX input time stamps: every input message on port P is preceded by a
+ * [P3 F4 HH LL] packet. HHLL is a 14 bit counter (wraps at 0x4000) that ticks
+ * every 100us, as measured in the captures in doc/wireshark/.
+ */
+#define SB_MIDEX_CLOCK_TICK_NS 100000
+#define SB_MIDEX_CLOCK_COUNTER_MASK 0x3fff
+#define SB_MIDEX_CLOCK_COUNTER_WRAP (SB_MIDEX_CLOCK_COUNTER_MASK + 1)
+/*
+ * Device clock estimator: every window of device time (with a few samples
+ * at least) contributes its least latency sample. The drift follows the
+ * slope between those with gain 1/SB_MIDEX_CLOCK_DRIFT_GAIN, the offset
+ * moves 1/SB_MIDEX_CLOCK_PHASE_GAIN of the way to them.
+ */
+#define SB_MIDEX_CLOCK_WINDOW_NS NSEC_PER_SEC
+#define SB_MIDEX_CLOCK_WINDOW_SAMPLES 4
+#define SB_MIDEX_CLOCK_DRIFT_GAIN 8
+#define SB_MIDEX_CLOCK_PHASE_GAIN 4
+#define SB_MIDEX_CLOCK_MAX_DRIFT_PPB (1000 * 1000) /* 1000 ppm */
+
+/* Per port staging of input bytes, delivered to ALSA in one call */
+#define SB_MIDEX_IN_BATCH_SIZE 256
+/* Input URB buffers queued for deferred processing (power of 2) */
+#define SB_MIDEX_IN_QUEUE_LEN 32
+
+/*
+ * USB MIDI packets queued for output by in-kernel sources, per port
+ * (power of 2)
+ */
+#define SB_MIDEX_OUT_QUEUE_LEN 256
+/*
+ * System real-time packets (0xF8-0xFF) waiting for the head of the next
+ * output urb (power of 2), and the urb kept free for them, after the
+ * SB_MIDEX_NUM_URBS_PER_EP urbs used for all output.
+ */
+#define SB_MIDEX_OUT_RT_QUEUE_LEN 32
+#define SB_MIDEX_OUT_RT_URB SB_MIDEX_NUM_URBS_PER_EP
+
+/*
+ * The urb buffers are carved out of three coherent DMA allocations, one per
+ * group of endpoints, each buffer starting on its own cache line. With
+ * cache lines of up to 128 bytes each one fits the largest (2048 byte) HCD
+ * buffer pool, so none takes a page of its own.
+ */
+enum sb_midex_dma_arena_index {
+	SB_MIDEX_DMA_MIDI_IN, /* EP2 in */
+	SB_MIDEX_DMA_MIDI_OUT, /* EP4 out, EP2 out */
+	SB_MIDEX_DMA_LED, /* EP6 out, EP6 in */
+	SB_MIDEX_NUM_DMA_ARENAS
+};
+
+#define SB_MIDEX_DMA_MIDI_IN_SIZE \
+	(SB_MIDEX_NUM_IN_URBS_MAX * L1_CACHE_ALIGN(SB_MIDEX_URB_BUFFER_SIZE))
+#define SB_MIDEX_DMA_MIDI_OUT_SIZE                                       \
+	((SB_MIDEX_OUT_RT_URB + 1 + SB_MIDEX_NUM_URBS_PER_EP) *            \
+	 L1_CACHE_ALIGN(SB_MIDEX_URB_BUFFER_SIZE))
+#define SB_MIDEX_DMA_LED_SIZE                                             \
+	(SB_MIDEX_NUM_URBS_PER_EP * L1_CACHE_ALIGN(SB_MIDEX_LED_BUFFER_SIZE) + \
+	 L1_CACHE_ALIGN(SB_MIDEX_LED_REPLY_BUFFER_SIZE))
 
 /*
  * VID is always 0x0a4e.
@@ -120,6 +273,10 @@ enum sb_midex_type {
 	SB_MIDEX_TYPE_8, /* 8 in, 8 out*/
 }; /* card type */
 
+/*
+ * MIDI output encoder state of a port. The channel message states keep the
+ * running status, the system common ones (SYS_) do not.
+ */
 enum sb_midex_port_state {
 	STATE_UNKNOWN = 0,
 	STATE_1PARAM = 1,
@@ -128,6 +285,35 @@ enum sb_midex_port_state {
 	STATE_SYSEX_0 = 4,
 	STATE_SYSEX_1 = 5,
 	STATE_SYSEX_2 = 6,
+	STATE_SYS_1PARAM = 7,
+	STATE_SYS_2PARAM_1 = 8,
+	STATE_SYS_2PARAM_2 = 9,
+	SB_MIDEX_NUM_PORT_STATES
+};
+
+/* MIDI byte classes of the output encoder, see sb_midex_encoder */
+enum sb_midex_byte_class {
+	BYTE_DATA = 0, /* 0x00-0x7f */
+	BYTE_STATUS_1, /* 0xc0-0xdf: channel message with 1 data byte */
+	BYTE_STATUS_2, /* other 0x80-0xef: channel message with 2 data bytes */
+	BYTE_SYSEX, /* 0xf0 */
+	BYTE_SYS_1, /* 0xf1, 0xf3 */
+	BYTE_SYS_2, /* 0xf2 */
+	BYTE_UNDEF, /* 0xf4, 0xf5 */
+	BYTE_TUNE, /* 0xf6 */
+	BYTE_EOX, /* 0xf7 */
+	BYTE_REALTIME, /* 0xf8-0xff */
+	SB_MIDEX_NUM_BYTE_CLASSES
+};
+
+enum sb_midex_encoder_action {
+	ENC_NONE = 0,
+	ENC_STORE0, /* midi_data[0] = byte */
+	ENC_STORE1, /* midi_data[1] = byte */
+	ENC_EMIT1, /* packet [byte 0 0] */
+	ENC_EMIT2, /* packet [midi_data[0] byte 0] */
+	ENC_EMIT3, /* packet [midi_data[0] midi_data[1] byte] */
+	ENC_REALTIME, /* to the real-time queue */
 };
 
 enum sb_midex_timing_state {
@@ -137,6 +323,24 @@ enum sb_midex_timing_state {
 	SB_MIDEX_TIMING_STOP,
 };
 
+/* Where the MIDI output runs after a trigger or completion */
+enum sb_midex_dispatch {
+	SB_MIDEX_DISPATCH_DIRECT = 0,
+	SB_MIDEX_DISPATCH_WORK,
+	SB_MIDEX_DISPATCH_THREAD,
+	SB_MIDEX_NUM_DISPATCH,
+};
+
+/* Endpoints watched by the urb health monitor */
+enum sb_midex_urb_ep {
+	SB_MIDEX_EP_TIMING_OUT = 0, /* EP 2 out */
+	SB_MIDEX_EP_MIDI_IN, /* EP 2 in */
+	SB_MIDEX_EP_MIDI_OUT, /* EP 4 out */
+	SB_MIDEX_EP_LED_OUT, /* EP 6 out */
+	SB_MIDEX_EP_LED_IN, /* EP 6 in */
+	SB_MIDEX_NUM_EPS,
+};
+
 enum sb_midex_led_state {
 	SB_MIDEX_LED_RUNNING = 0,
 	SB_MIDEX_LED_INIT,
@@ -147,29 +351,234 @@ enum sb_midex_led_state {
 
 struct sb_midex;
 
+struct sb_midex_dma_arena {
+	void *buffer; /* NULL if not allocated */
+	dma_addr_t dma;
+	unsigned int size;
+	unsigned int used;
+};
+
+/* Input bytes of a port not yet passed to ALSA */
+struct sb_midex_in_batch {
+	uint8_t data[SB_MIDEX_IN_BATCH_SIZE];
+	unsigned int len;
+};
+
 struct sb_midex_port {
 	struct snd_rawmidi_substream *substream;
 	int triggered;
 	enum sb_midex_port_state state;
 	uint8_t midi_data[2];
+	ktime_t tstamp; /* input: host time of the last [P3 F4 XXXX] packet */
+	uint8_t realtime_filter; /* input: bit n drops 0xF8 + n */
+	uint8_t thru; /* input: bit n copies the input to output port n */
+	ktime_t wire_free; /* output: time the DIN line has sent all it got */
+	ktime_t sent; /* output: time the substream last sent bytes */
+	unsigned int urbs_in_flight; /* output: urbs with data for the port */
+	struct sb_midex_in_batch *batch; /* input: staging buffer */
+};
+
+/*
+ * Maps the MIDEX time counter onto CLOCK_MONOTONIC:
+ *   host = ref_host + (device - ref_device) * (1 + drift)
+ * USB and softirq latency only ever delay the arrival, so the estimate
+ * follows the samples with the least latency (see SB_MIDEX_CLOCK_WINDOW_NS),
+ * and a sample arriving before its estimate moves the estimate at once.
+ */
+struct sb_midex_clock {
+	bool valid;
+	uint16_t last_count;
+	u64 ticks; /* unwrapped device counter */
+	ktime_t last_host;
+
+	u64 ref_device_ns;
+	s64 ref_host_ns;
+	s64 drift_ppb; /* kept over restarts, it is the device's crystal */
+
+	/* current window, and the least latency sample in it */
+	u64 win_start_ns;
+	unsigned int win_samples;
+	u64 win_device_ns;
+	s64 win_host_ns;
+	s64 win_max_err_ns;
+	/* least latency sample of the previous window */
+	bool prev_valid;
+	u64 prev_device_ns;
+	s64 prev_host_ns;
+
+	/* statistics */
+	s64 jitter_ns; /* latency spread in the last window */
+	u64 samples;
+	u64 windows;
 };
 
 struct sb_midex_urb_ctx {
 	struct urb *urb;
 	struct sb_midex *midex;
-	bool active;
+	uint8_t ports; /* output: bit n set if the urb has data for port n */
+	uint8_t ep; /* enum sb_midex_urb_ep */
+	uint8_t index; /* bit in sb_midex.urb_busy[ep] */
+	bool replay; /* taken over by the recovery, to be sent again */
+	ktime_t submitted; /* 0 while not in flight */
+	u32 seq; /* output: submit order */
+};
+
+/* Per endpoint state of the urb health monitor */
+struct sb_midex_urb_health {
+	struct sb_midex_urb_ctx *urbs;
+	unsigned int num_urbs;
+	u64 stuck_ns; /* 0: only stalls are recovered */
+	ktime_t last_complete;
+	unsigned int failed_recoveries; /* since the last transfer */
+
+	/* statistics */
+	u64 max_age_ns; /* longest submit to completion */
+	u64 stalls;
+	u64 recoveries;
 };
 
+/*
+ * The input endpoint is used without locks: its completions are serialized
+ * by the host controller, and the substream pointers (published on
+ * open/close) and triggered/active flags are single words accessed with
+ * READ/WRITE_ONCE. Publishing takes the endpoint lock, which the output
+ * endpoint also holds while it sends.
+ */
 struct sb_midex_endpoint {
 	struct sb_midex_port ports[8];
-	struct sb_midex_urb_ctx urbs[SB_MIDEX_NUM_URBS_PER_EP];
+	struct sb_midex_urb_ctx *urbs; /* midi_in_urbs or midi_out_urbs */
 	int num_ports;
-	int last_active_port;
 
 	spinlock_t lock;
 	bool active;
 };
 
+/* A received input URB buffer, waiting for deferred processing */
+struct sb_midex_in_record {
+	ktime_t arrival;
+	unsigned int len;
+	uint8_t data[SB_MIDEX_URB_BUFFER_SIZE];
+};
+
+/*
+ * Single producer (input completion), single consumer (work) ring of
+ * received input buffers.
+ */
+struct sb_midex_in_queue {
+	struct sb_midex_in_record records[SB_MIDEX_IN_QUEUE_LEN];
+	unsigned int head;
+	unsigned int tail;
+	u64 overruns;
+	struct work_struct work;
+};
+
+/* Adaptive MIDI input urb pool, see SB_MIDEX_NUM_IN_URBS_MIN */
+struct sb_midex_in_pool {
+	unsigned int depth; /* number of urbs to keep submitted */
+	unsigned int high_water; /* largest depth so far */
+	atomic_t in_flight;
+	unsigned int full_streak; /* back-to-back full completions */
+	bool busy; /* full completion since the last timing period */
+	unsigned int idle_ticks;
+};
+
+/* One 4 byte MIDEX USB MIDI packet: [PS XX XX XX] */
+struct sb_midex_packet {
+	uint8_t data[4];
+};
+
+/* Packets of in-kernel sources (sequencer, thru, scheduler) for a port */
+struct sb_midex_out_queue {
+	DECLARE_KFIFO(fifo, struct sb_midex_packet, SB_MIDEX_OUT_QUEUE_LEN);
+};
+
+/* SysEx bytes on their way into [P4..P7] packets */
+struct sb_midex_sysex_packer {
+	bool active; /* F0 seen */
+	uint8_t data[3];
+	unsigned int len;
+};
+
+#if IS_ENABLED(CONFIG_SND_SEQUENCER)
+/* A MIDEX port as seen by the in-kernel sequencer client */
+struct sb_midex_seq_port {
+	struct sb_midex *midex;
+	int number; /* MIDEX port number */
+	atomic_t subscribers; /* readers of the input */
+
+	/* input: SysEx bytes received, not yet dispatched */
+	uint8_t sysex_in[SB_MIDEX_IN_BATCH_SIZE];
+	unsigned int sysex_in_len;
+	ktime_t sysex_in_tstamp;
+
+	/* output: SysEx bytes not yet packed in a packet */
+	struct sb_midex_sysex_packer sysex_out;
+};
+
+struct sb_midex_seq {
+	int client; /* < 0 if not created */
+	struct sb_midex_seq_port ports[8];
+};
+#endif
+
+#ifdef SB_MIDEX_HAVE_UMP
+/* The MIDI 2.0 UMP endpoint: UMP group n is MIDEX port n */
+struct sb_midex_ump {
+	struct snd_ump_endpoint *ep; /* NULL if not created */
+	bool in_active;
+	bool out_active;
+
+	/* input: words not yet passed to ALSA, 2 per packet at most */
+	u32 in_words[SB_MIDEX_URB_BUFFER_SIZE / 2];
+	unsigned int in_len;
+
+	/* output: SysEx7 bytes not yet packed in a packet, per group */
+	struct sb_midex_sysex_packer sysex_out[8];
+	/* output: a packet held back while its group is paced */
+	u32 out_words[4];
+	int out_len;
+};
+#endif
+
+/* A queued struct sb_midex_sched_event, in the order it was queued */
+struct sb_midex_sched_entry {
+	s64 deadline_ns;
+	u32 seq;
+	uint8_t packet[4];
+};
+
+/* MIDI output queued through the hwdep device, sent from a timer */
+struct sb_midex_sched {
+	spinlock_t lock;
+	/* binary min-heap on (deadline, seq), the next event first */
+	struct sb_midex_sched_entry events[SB_MIDEX_SCHED_LEN];
+	unsigned int len;
+	u32 seq;
+	struct hrtimer timer; /* at the first deadline */
+	u64 sent;
+	u64 late;
+	u64 dropped; /* the port's output queue was full at the deadline */
+};
+
+/*
+ * MIDI clock generator: 0xF8 at 24 per quarter note on the enabled output
+ * ports. The controls are serialized by the control layer.
+ */
+struct sb_midex_clock_gen {
+	struct hrtimer timer;
+	unsigned int tempo; /* 1/100 BPM */
+	uint8_t ports; /* bit n sends the clock on output port n */
+	bool running;
+	u64 ticks;
+};
+
+/* Run time statistics of a completion handler */
+struct sb_midex_perf {
+	u64 count;
+	u64 total_ns;
+	u64 max_ns;
+};
+
 struct sb_midex {
 	struct usb_device *usbdev;
 	struct snd_card *card;
@@ -183,24 +592,91 @@ struct sb_midex {
 	/* Timer */
 	spinlock_t timer_timing_lock;
 	enum sb_midex_timing_state timing_state;
-	struct hrtimer timer_timing;
-	struct timer_list timer_led;
+	struct hrtimer timer_timing; /* also runs the LED work */
+	bool timer_timing_active; /* armed; stops when idle */
+	bool timer_timing_gone; /* not started yet or disconnected */
+	int led_ticks; /* timing periods until the next LED work */
+	u64 timer_timing_ticks;
 	ktime_t timer_timing_deltat;
 
+	/* Device clock, only used from the MIDI input completion */
+	struct sb_midex_clock clock;
+	atomic_t clock_restart; /* timing START sent, reset the clock */
+
 	/* LED */
 	enum sb_midex_led_state led_state;
 	int led_state_gfx;
 	int led_num_packets_to_send;
+	unsigned int led_max_len; /* bytes of LED commands per urb */
+	unsigned int led_runs; /* LED work runs since the last keepalive */
+	/* bits 0-7: input, 8-15: output on the port since the last LED work */
+	atomic_t led_activity;
+	uint8_t led_shown[8]; /* sides lit per port LED, 0xff: unknown */
+	u64 led_transfers;
+
+	/* bit n: urb n of the endpoint is claimed or in flight */
+	unsigned long urb_busy[SB_MIDEX_NUM_EPS];
+
+	/* URB health monitor */
+	struct sb_midex_urb_health urb_health[SB_MIDEX_NUM_EPS];
+	struct hrtimer urb_monitor;
+	struct work_struct urb_recover_work;
+	unsigned long urb_flags;
+	/* bit per endpoint, set until the recovery work takes it */
+	unsigned long urb_stalled;
+	unsigned long urb_stuck;
+	unsigned long urb_recovering; /* bit per endpoint under recovery */
+	u64 urb_empty_refused;
 
 	/* MIDI */
-	struct tasklet_struct midi_out_tasklet;
-	wait_queue_head_t drain_wait;
-	unsigned int drain_urbs;
+	/* output dispatch, see sb_midex_usb_midi_output_kick() */
+	struct work_struct midi_out_work;
+	struct kthread_worker *midi_out_worker; /* NULL until mode 2 is used */
+	struct kthread_work midi_out_kthread_work;
+	struct work_struct midi_out_thread_start;
+	bool midi_out_thread_failed; /* mode 2 uses the work item */
+	ktime_t midi_out_kick_time; /* 0 if no kick is pending */
+	unsigned int midi_out_kick_mode;
+	struct sb_midex_perf midi_out_dispatch_perf[SB_MIDEX_NUM_DISPATCH];
+	u64 midi_out_dispatch_packets[SB_MIDEX_NUM_DISPATCH];
+	struct hrtimer midi_out_pace_timer;
+	struct sb_midex_sched sched;
+	struct sb_midex_clock_gen clock_gen;
+	wait_queue_head_t drain_wait; /* woken when urbs_in_flight drops */
 
 	/* EP 2 in */
 	struct sb_midex_endpoint midi_in;
+	struct sb_midex_urb_ctx midi_in_urbs[SB_MIDEX_NUM_IN_URBS_MAX];
+	struct sb_midex_in_batch midi_in_batch[8];
+	struct sb_midex_perf midi_in_perf;
+	struct sb_midex_in_queue midi_in_queue;
+	struct sb_midex_in_pool midi_in_pool;
+	u64 midi_in_packets;
+	u64 midi_in_deliveries;
+	uint8_t midi_thru_inputs; /* bit n: input port n has thru outputs */
+	u64 midi_thru_packets;
 	/* EP 4 out */
 	struct sb_midex_endpoint midi_out;
+	struct sb_midex_urb_ctx midi_out_urbs[SB_MIDEX_OUT_RT_URB + 1];
+	unsigned int midi_out_max_len; /* bytes of MIDI output per urb */
+	int midi_out_first_port; /* went first in the last urb */
+	/* packets from in-kernel sources, under midi_out.lock */
+	struct sb_midex_out_queue midi_out_queues[8];
+	u64 midi_out_queue_overruns;
+	/* real-time packets of all sources, under midi_out.lock */
+	DECLARE_KFIFO(midi_out_rt_queue, struct sb_midex_packet,
+		      SB_MIDEX_OUT_RT_QUEUE_LEN);
+	u64 midi_out_rt_overruns;
+	u64 midi_out_rt_urbs; /* urbs sent on the reserved urb */
+	u32 midi_out_seq;
+	bool midi_out_recovering; /* new output waits for the replayed urbs */
+
+#if IS_ENABLED(CONFIG_SND_SEQUENCER)
+	struct sb_midex_seq seq;
+#endif
+#ifdef SB_MIDEX_HAVE_UMP
+	struct sb_midex_ump ump;
+#endif
 
 	/* EP 2 out */
 	struct sb_midex_urb_ctx timing_out_urb[SB_MIDEX_NUM_URBS_PER_EP];
@@ -209,6 +685,9 @@ struct sb_midex {
 	/* EP 6 in */
 	struct sb_midex_urb_ctx led_replies_urb;
 
+	/* urb buffers, see enum sb_midex_dma_arena_index */
+	struct sb_midex_dma_arena dma_arenas[SB_MIDEX_NUM_DMA_ARENAS];
+
 	struct usb_anchor anchor;
 };
 
@@ -220,7 +699,43 @@ static void sb_midex_usb_midi_input_start(struct sb_midex *midex);
 static void sb_midex_usb_midi_input_stop(struct sb_midex *midex);
 static void
 sb_midex_usb_midi_output_drain(struct snd_rawmidi_substream *substream);
-static enum hrtimer_restart sb_midex_timer_timing_callback(struct hrtimer *hrt);
+static void sb_midex_timing_tick(struct sb_midex *midex);
+static void sb_midex_timing_send(struct sb_midex *midex);
+static void sb_midex_led_tick(struct sb_midex *midex);
+static void sb_midex_timer_timing_wake(struct sb_midex *midex);
+static bool sb_midex_usb_midi_output_queue_packet(struct sb_midex *midex,
+						  uint8_t p0, uint8_t p1,
+						  uint8_t p2, uint8_t p3);
+static bool
+sb_midex_usb_midi_output_queue_locked(struct sb_midex *midex,
+				      const struct sb_midex_packet *packet);
+#if IS_ENABLED(CONFIG_SND_SEQUENCER)
+static void sb_midex_seq_input(struct sb_midex *midex, const uint8_t *packets,
+			       unsigned int num_packets, ktime_t tstamp);
+static void sb_midex_seq_input_flush(struct sb_midex *midex);
+#endif
+static void sb_midex_usb_midi_output_drain_urbs(struct sb_midex *midex,
+						unsigned int port_mask);
+static void sb_midex_usb_midi_output(struct sb_midex *midex);
+static void sb_midex_usb_midi_output_kick(struct sb_midex *midex);
+static void sb_midex_usb_midi_output_replay(struct sb_midex *midex);
+static bool sb_midex_usb_midi_output_paced(struct sb_midex_port *port,
+					   ktime_t now, ktime_t *wake);
+static void sb_midex_usb_midi_output_pace_charge(struct sb_midex *midex,
+						 const struct urb *urb,
+						 unsigned int from, ktime_t now);
+static void sb_midex_usb_midi_output_packet(struct urb *urb, uint8_t p0,
+					    uint8_t p1, uint8_t p2,
+					    uint8_t p3);
+static bool sb_midex_usb_midi_output_queue_rt(struct sb_midex *midex,
+					      uint8_t port, uint8_t b);
+#ifdef SB_MIDEX_HAVE_UMP
+static void sb_midex_ump_input(struct sb_midex *midex, const uint8_t *packets,
+			       unsigned int num_packets);
+static void sb_midex_ump_input_flush(struct sb_midex *midex);
+static void sb_midex_ump_output(struct sb_midex *midex, struct urb *urb,
+				ktime_t now, ktime_t *wake);
+#endif
 
 /*******************************************************************
  * Internal global variables
@@ -229,6 +744,70 @@ static enum hrtimer_restart sb_midex_timer_timing_callback(struct hrtimer *hrt);
 static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;
 static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;
 
+static bool seq_client;
+module_param(seq_client, bool, 0444);
+MODULE_PARM_DESC(seq_client,
+		 "Register an in-kernel ALSA sequencer client with one port per MIDEX port. Default off.");
+
+static bool ump_endpoint;
+module_param(ump_endpoint, bool, 0444);
+MODULE_PARM_DESC(ump_endpoint,
+		 "Add a MIDI 2.0 UMP endpoint, with one group per MIDEX port (kernel 6.5 and later). Default off.");
+
+static int input_realtime_filter;
+module_param(input_realtime_filter, int, 0444);
+MODULE_PARM_DESC(input_realtime_filter,
+		 "Initial filter mask of received realtime messages, bit n drops 0xF8 + n (e.g. 0x40 for active sensing, 0x01 for clock). Default 0.");
+
+static int output_urb_payload = 32;
+module_param(output_urb_payload, int, 0444);
+MODULE_PARM_DESC(output_urb_payload,
+		 "Bytes of MIDI output per urb: 0 uses the wMaxPacketSize of EP4 (up to 64). Default 32, until larger transfers are confirmed with the EP4 benchmark.");
+
+static bool output_pacing = true;
+module_param(output_pacing, bool, 0444);
+MODULE_PARM_DESC(output_pacing,
+		 "Pace MIDI output of every port to its DIN line rate, so a busy port cannot fill the device's buffers for the others. Default on.");
+
+static int output_dispatch = SB_MIDEX_DISPATCH_WORK;
+
+static int sb_midex_output_dispatch_set(const char *val,
+					const struct kernel_param *kp)
+{
+	int mode;
+	int ret;
+
+	ret = kstrtoint(val, 0, &mode);
+	if (ret)
+		return ret;
+
+	if (mode < 0 || mode >= SB_MIDEX_NUM_DISPATCH)
+		return -EINVAL;
+
+	/* a device starts its thread with the next kick */
+	WRITE_ONCE(output_dispatch, mode);
+	return 0;
+}
+
+static const struct kernel_param_ops sb_midex_output_dispatch_ops = {
+	.set = sb_midex_output_dispatch_set,
+	.get = param_get_int,
+};
+module_param_cb(output_dispatch, &sb_midex_output_dispatch_ops,
+		&output_dispatch, 0644);
+MODULE_PARM_DESC(output_dispatch,
+		 "Where MIDI output runs: 0 directly in the trigger/completion, 1 in a (BH) work item, 2 in a realtime kernel thread. Default 1.");
+
+static bool led_batch;
+module_param(led_batch, bool, 0444);
+MODULE_PARM_DESC(led_batch,
+		 "Pack several activity LED commands into one EP6 transfer, and light both sides of a port LED for input and output at once. Neither is confirmed on hardware. Default off.");
+
+static bool input_deferred;
+module_param(input_deferred, bool, 0444);
+MODULE_PARM_DESC(input_deferred,
+		 "Parse MIDI input in a work item instead of the URB completion. Default off.");
+
 static DEFINE_MUTEX(devices_mutex);
 static DECLARE_BITMAP(devices_used, SNDRV_CARDS);
 static struct usb_driver sb_midex_driver;
@@ -240,26 +819,242 @@ static const uint8_t sb_midex_cin_length[] = {
 	8, 9, a, b, c, d, e, f  */
 };
 
+static const uint8_t sb_midex_byte_class[256] = {
+	[0x00 ... 0x7f] = BYTE_DATA,	 [0x80 ... 0xbf] = BYTE_STATUS_2,
+	[0xc0 ... 0xdf] = BYTE_STATUS_1, [0xe0 ... 0xef] = BYTE_STATUS_2,
+	[0xf0] = BYTE_SYSEX,		 [0xf1] = BYTE_SYS_1,
+	[0xf2] = BYTE_SYS_2,		 [0xf3] = BYTE_SYS_1,
+	[0xf4 ... 0xf5] = BYTE_UNDEF,	 [0xf6] = BYTE_TUNE,
+	[0xf7] = BYTE_EOX,		 [0xf8 ... 0xff] = BYTE_REALTIME,
+};
+
+/*
+ * One step of the output encoder: the action on the byte, the code index
+ * number of an emitted packet (0: the high nibble of the channel status in
+ * midi_data[0]) and the next state.
+ */
+struct sb_midex_encoder_step {
+	uint8_t action;
+	uint8_t cin;
+	uint8_t state;
+};
+
+#define SB_MIDEX_ENC(a, c, s) { .action = (a), .cin = (c), .state = (s) }
+#define SB_MIDEX_ENC_IGNORE SB_MIDEX_ENC(ENC_NONE, 0, STATE_UNKNOWN)
+
+/* A state's steps; status bytes act the same in all states but for 0xf7 */
+#define SB_MIDEX_ENC_STATE(self, data, eox)                                   \
+	{                                                                     \
+		[BYTE_DATA] = data,                                           \
+		[BYTE_STATUS_1] = SB_MIDEX_ENC(ENC_STORE0, 0, STATE_1PARAM),  \
+		[BYTE_STATUS_2] = SB_MIDEX_ENC(ENC_STORE0, 0, STATE_2PARAM_1),\
+		[BYTE_SYSEX] = SB_MIDEX_ENC(ENC_STORE0, 0, STATE_SYSEX_1),    \
+		[BYTE_SYS_1] = SB_MIDEX_ENC(ENC_STORE0, 0, STATE_SYS_1PARAM), \
+		[BYTE_SYS_2] =                                                \
+			SB_MIDEX_ENC(ENC_STORE0, 0, STATE_SYS_2PARAM_1),      \
+		[BYTE_UNDEF] = SB_MIDEX_ENC_IGNORE,                           \
+		[BYTE_TUNE] = SB_MIDEX_ENC(ENC_EMIT1, 0x05, STATE_UNKNOWN),   \
+		[BYTE_EOX] = eox,                                             \
+		[BYTE_REALTIME] = SB_MIDEX_ENC(ENC_REALTIME, 0, self),        \
+	}
+
+/*
+ * The MIDI to USB MIDI packet encoder, by state and byte class.
+ * \note (Same packets as the ALSA USB MIDI driver's snd_usbmidi_transmit_byte)
+ */
+static const struct sb_midex_encoder_step
+	sb_midex_encoder[SB_MIDEX_NUM_PORT_STATES][SB_MIDEX_NUM_BYTE_CLASSES] = {
+	[STATE_UNKNOWN] = SB_MIDEX_ENC_STATE(STATE_UNKNOWN,
+					     SB_MIDEX_ENC_IGNORE,
+					     SB_MIDEX_ENC_IGNORE),
+	[STATE_1PARAM] = SB_MIDEX_ENC_STATE(
+		STATE_1PARAM, SB_MIDEX_ENC(ENC_EMIT2, 0, STATE_1PARAM),
+		SB_MIDEX_ENC_IGNORE),
+	[STATE_2PARAM_1] = SB_MIDEX_ENC_STATE(
+		STATE_2PARAM_1, SB_MIDEX_ENC(ENC_STORE1, 0, STATE_2PARAM_2),
+		SB_MIDEX_ENC_IGNORE),
+	[STATE_2PARAM_2] = SB_MIDEX_ENC_STATE(
+		STATE_2PARAM_2, SB_MIDEX_ENC(ENC_EMIT3, 0, STATE_2PARAM_1),
+		SB_MIDEX_ENC_IGNORE),
+	[STATE_SYSEX_0] = SB_MIDEX_ENC_STATE(
+		STATE_SYSEX_0, SB_MIDEX_ENC(ENC_STORE0, 0, STATE_SYSEX_1),
+		SB_MIDEX_ENC(ENC_EMIT1, 0x05, STATE_UNKNOWN)),
+	[STATE_SYSEX_1] = SB_MIDEX_ENC_STATE(
+		STATE_SYSEX_1, SB_MIDEX_ENC(ENC_STORE1, 0, STATE_SYSEX_2),
+		SB_MIDEX_ENC(ENC_EMIT2, 0x06, STATE_UNKNOWN)),
+	[STATE_SYSEX_2] = SB_MIDEX_ENC_STATE(
+		STATE_SYSEX_2, SB_MIDEX_ENC(ENC_EMIT3, 0x04, STATE_SYSEX_0),
+		SB_MIDEX_ENC(ENC_EMIT3, 0x07, STATE_UNKNOWN)),
+	[STATE_SYS_1PARAM] = SB_MIDEX_ENC_STATE(
+		STATE_SYS_1PARAM, SB_MIDEX_ENC(ENC_EMIT2, 0x02, STATE_UNKNOWN),
+		SB_MIDEX_ENC_IGNORE),
+	[STATE_SYS_2PARAM_1] = SB_MIDEX_ENC_STATE(
+		STATE_SYS_2PARAM_1,
+		SB_MIDEX_ENC(ENC_STORE1, 0, STATE_SYS_2PARAM_2),
+		SB_MIDEX_ENC_IGNORE),
+	[STATE_SYS_2PARAM_2] = SB_MIDEX_ENC_STATE(
+		STATE_SYS_2PARAM_2,
+		SB_MIDEX_ENC(ENC_EMIT3, 0x03, STATE_UNKNOWN),
+		SB_MIDEX_ENC_IGNORE),
+};
+
+static const char *const sb_midex_urb_ep_names[SB_MIDEX_NUM_EPS] = {
+	"EP2 out (timing)", "EP2 in (MIDI)", "EP4 out (MIDI)",
+	"EP6 out (LED)",    "EP6 in (LED)",
+};
+
+/* Starts the urb health monitor, if it is not running */
+static void sb_midex_urb_monitor_arm(struct sb_midex *midex)
+{
+	if (!test_bit(SB_MIDEX_URB_GONE, &midex->urb_flags) &&
+	    !test_and_set_bit(SB_MIDEX_URB_MONITOR_ARMED, &midex->urb_flags))
+		hrtimer_start(&midex->urb_monitor,
+			      ns_to_ktime(SB_MIDEX_URB_MONITOR_NS),
+			      HRTIMER_MODE_REL);
+}
+
+/* Returns true from a stall or stuck urb until the endpoint is recovered */
+static bool sb_midex_urb_recovering(struct sb_midex *midex,
+				    enum sb_midex_urb_ep ep)
+{
+	return test_bit(ep, &midex->urb_stalled) ||
+	       test_bit(ep, &midex->urb_stuck) ||
+	       test_bit(ep, &midex->urb_recovering);
+}
+
+/*
+ * URB ownership: a set bit in urb_busy[] owns the urb, from the claim until
+ * the completion (or a failed submit) releases it. Claiming and releasing
+ * are single atomic bit operations, safe from any context, so finding a free
+ * urb needs no lock.
+ */
+static bool sb_midex_urb_claim(struct sb_midex_urb_ctx *ctx)
+{
+	return !test_and_set_bit_lock(ctx->index,
+				      &ctx->midex->urb_busy[ctx->ep]);
+}
+
+/* Claims a free urb among urbs @first to @num_urbs - 1 of the endpoint */
+static struct sb_midex_urb_ctx *
+sb_midex_urb_claim_free(struct sb_midex *midex, enum sb_midex_urb_ep ep,
+			unsigned int first, unsigned int num_urbs)
+{
+	unsigned long *busy = &midex->urb_busy[ep];
+	unsigned int i;
+
+	for (i = find_next_zero_bit(busy, num_urbs, first); i < num_urbs;
+	     i = find_next_zero_bit(busy, num_urbs, i + 1))
+		if (!test_and_set_bit_lock(i, busy))
+			return &midex->urb_health[ep].urbs[i];
+
+	return NULL;
+}
+
+static void sb_midex_urb_release(struct sb_midex_urb_ctx *ctx)
+{
+	WRITE_ONCE(ctx->submitted, 0);
+	clear_bit_unlock(ctx->index, &ctx->midex->urb_busy[ctx->ep]);
+}
+
+static bool sb_midex_urb_busy(const struct sb_midex_urb_ctx *ctx)
+{
+	return test_bit(ctx->index, &ctx->midex->urb_busy[ctx->ep]);
+}
+
 /*
- * Submits the URB, with error handling.
+ * Submits the URB, which the caller claimed, with error handling. On
+ * failure the urb is released.
+ * A zero-length OUT transfer is refused: the MIDEX does not complete it, and
+ * the endpoint hangs (see the empty_urb capture in doc/wireshark/).
  */
 static int sb_midex_submit_urb(struct sb_midex_urb_ctx *ctx, gfp_t flags,
 			       const char *function)
 {
+	struct sb_midex *midex = ctx->midex;
 	int err = 0;
 
+	if (usb_pipeout(ctx->urb->pipe) && !ctx->urb->transfer_buffer_length) {
+		WRITE_ONCE(midex->urb_empty_refused,
+			   midex->urb_empty_refused + 1);
+		dev_dbg(&ctx->urb->dev->dev,
+			SB_MIDEX_PREFIX "empty urb refused at %s\n", function);
+		sb_midex_urb_release(ctx);
+		return -EINVAL;
+	}
+
+	/* set first, the completion may run before we return */
+	WRITE_ONCE(ctx->submitted, ktime_get());
 	err = usb_submit_urb(ctx->urb, flags);
 
-	if (err < 0)
+	if (err < 0) {
+		sb_midex_urb_release(ctx);
 		dev_err(&ctx->urb->dev->dev,
 			SB_MIDEX_PREFIX "usb_submit_urb: %d at %s\n", err,
 			function);
-	else
-		ctx->active = true;
+	} else if (midex->urb_health[ctx->ep].stuck_ns) {
+		sb_midex_urb_monitor_arm(midex);
+	}
 
 	return err;
 }
 
+/*
+ * Urb health bookkeeping at the start of a completion: the urb's age, and a
+ * stall (-EPIPE) is handed to the recovery work. Returns true if the
+ * recovery took the urb over, to send it again; the completion must then
+ * leave it alone. Only urbs that were killed or stalled are sent again: one
+ * that went through before the recovery could kill it is done.
+ */
+static bool sb_midex_urb_completed(struct sb_midex_urb_ctx *ctx)
+{
+	struct sb_midex *midex = ctx->midex;
+	struct sb_midex_urb_health *health = &midex->urb_health[ctx->ep];
+	ktime_t now = ktime_get();
+	u64 age = ktime_to_ns(ktime_sub(now, READ_ONCE(ctx->submitted)));
+
+	WRITE_ONCE(health->last_complete, now);
+	if (age > health->max_age_ns)
+		WRITE_ONCE(health->max_age_ns, age);
+	if (!ctx->urb->status)
+		WRITE_ONCE(health->failed_recoveries, 0);
+
+	if (ctx->urb->status == -EPIPE &&
+	    !test_bit(SB_MIDEX_URB_GONE, &midex->urb_flags)) {
+		WRITE_ONCE(health->stalls, health->stalls + 1);
+		if (ctx->ep == SB_MIDEX_EP_MIDI_OUT)
+			WRITE_ONCE(ctx->replay, true);
+		/* no resubmits into the halted endpoint */
+		else if (ctx->ep == SB_MIDEX_EP_MIDI_IN)
+			WRITE_ONCE(midex->midi_in.active, false);
+		set_bit(ctx->ep, &midex->urb_stalled);
+		schedule_work(&midex->urb_recover_work);
+	}
+
+	if (!READ_ONCE(ctx->replay))
+		return false;
+
+	switch (ctx->urb->status) {
+	case -ENOENT:
+	case -ECONNRESET:
+	case -EPIPE:
+		return true;
+	default:
+		/* the replay runs after this, once the urbs are killed */
+		WRITE_ONCE(ctx->replay, false);
+		return false;
+	}
+}
+
+static void sb_midex_perf_add(struct sb_midex_perf *perf, ktime_t start)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	WRITE_ONCE(perf->count, perf->count + 1);
+	WRITE_ONCE(perf->total_ns, perf->total_ns + ns);
+	if (ns > perf->max_ns)
+		WRITE_ONCE(perf->max_ns, ns);
+}
+
 static int sb_midex_urb_show_error(const struct urb *urb, const char *func)
 {
 	switch (urb->status) {
@@ -281,22 +1076,60 @@ static int sb_midex_urb_show_error(const struct urb *urb, const char *func)
 	}
 }
 
-static void sb_midex_urb_and_buffer_free(struct sb_midex *midex,
-					 struct urb *urb,
-					 unsigned int buffer_length)
+static int sb_midex_dma_arena_alloc(struct sb_midex *midex,
+				    enum sb_midex_dma_arena_index index,
+				    unsigned int size)
+{
+	struct sb_midex_dma_arena *arena = &midex->dma_arenas[index];
+
+	arena->buffer = usb_alloc_coherent(midex->usbdev, size, GFP_KERNEL,
+					   &arena->dma);
+	if (!arena->buffer)
+		return -ENOMEM;
+	arena->size = size;
+	arena->used = 0;
+	return 0;
+}
+
+static void sb_midex_dma_arena_free(struct sb_midex *midex)
+{
+	struct sb_midex_dma_arena *arena;
+	int index;
+
+	for (index = 0; index < SB_MIDEX_NUM_DMA_ARENAS; index++) {
+		arena = &midex->dma_arenas[index];
+		if (arena->buffer)
+			usb_free_coherent(midex->usbdev, arena->size,
+					  arena->buffer, arena->dma);
+		arena->buffer = NULL;
+	}
+}
+
+/*
+ * Takes the next @buffer_length bytes of a DMA arena, rounded up to a
+ * cache line. Returns NULL when the arena is full.
+ */
+static void *sb_midex_dma_arena_carve(struct sb_midex_dma_arena *arena,
+				      unsigned int buffer_length,
+				      dma_addr_t *dma)
 {
-	if (urb)
-		usb_free_coherent(midex->usbdev, buffer_length,
-				  urb->transfer_buffer, urb->transfer_dma);
+	unsigned int offset = arena->used;
+	unsigned int size = L1_CACHE_ALIGN(buffer_length);
 
-	usb_free_urb(urb);
+	if (WARN_ON(!arena->buffer || offset + size > arena->size))
+		return NULL;
+
+	arena->used += size;
+	*dma = arena->dma + offset;
+	return (uint8_t *)arena->buffer + offset;
 }
 
-static struct urb *sb_midex_urb_and_buffer_alloc(struct sb_midex *midex,
-						 unsigned int pipe,
-						 unsigned int buffer_length,
-						 usb_complete_t complete_fn,
-						 void *context)
+/* Allocates an urb, with its buffer in a DMA arena */
+static struct urb *
+sb_midex_urb_and_buffer_alloc(struct sb_midex *midex,
+			      struct sb_midex_dma_arena *arena,
+			      unsigned int pipe, unsigned int buffer_length,
+			      usb_complete_t complete_fn, void *context)
 {
 	struct urb *urb = NULL;
 	void *buffer = NULL;
@@ -304,8 +1137,8 @@ static struct urb *sb_midex_urb_and_buffer_alloc(struct sb_midex *midex,
 	urb = usb_alloc_urb(0, GFP_KERNEL);
 
 	if (urb != NULL) {
-		buffer = usb_alloc_coherent(midex->usbdev, buffer_length,
-					    GFP_KERNEL, &urb->transfer_dma);
+		buffer = sb_midex_dma_arena_carve(arena, buffer_length,
+						  &urb->transfer_dma);
 
 		if (buffer != NULL) {
 			usb_fill_int_urb(urb, midex->usbdev, pipe, buffer,
@@ -326,41 +1159,172 @@ static struct urb *sb_midex_urb_and_buffer_alloc(struct sb_midex *midex,
 	return urb;
 }
 
+/******************************************************************************
+ * Device clock functions
+ ******************************************************************************/
+
+/* Restarts the mapping, as the device counter restarts; keeps the drift */
+static void sb_midex_clock_reset(struct sb_midex_clock *clock)
+{
+	clock->valid = false;
+	clock->ticks = 0;
+	clock->prev_valid = false;
+	clock->win_samples = 0;
+}
+
+/* Returns the estimated host time of device time @device_ns */
+static s64 sb_midex_clock_predict(const struct sb_midex_clock *clock,
+				  u64 device_ns)
+{
+	s64 elapsed = device_ns - clock->ref_device_ns;
+
+	return clock->ref_host_ns + elapsed +
+	       div_s64(div_s64(elapsed, NSEC_PER_USEC) * clock->drift_ppb,
+		       USEC_PER_SEC);
+}
+
+/*
+ * Closes a window: the drift follows the slope from the previous window's
+ * least latency sample to this one's, and the offset moves part of the way
+ * to it.
+ */
+static void sb_midex_clock_window(struct sb_midex_clock *clock)
+{
+	s64 device_elapsed = clock->win_device_ns - clock->prev_device_ns;
+	s64 host_elapsed = clock->win_host_ns - clock->prev_host_ns;
+	s64 drift_ppb;
+	s64 estimate;
+
+	if (clock->prev_valid && device_elapsed > 0) {
+		drift_ppb = div64_s64((host_elapsed - device_elapsed) *
+					      NSEC_PER_SEC,
+				      device_elapsed);
+		drift_ppb = clamp_t(s64, drift_ppb,
+				    -SB_MIDEX_CLOCK_MAX_DRIFT_PPB,
+				    SB_MIDEX_CLOCK_MAX_DRIFT_PPB);
+		clock->drift_ppb += div_s64(drift_ppb - clock->drift_ppb,
+					    SB_MIDEX_CLOCK_DRIFT_GAIN);
+	}
+
+	estimate = sb_midex_clock_predict(clock, clock->win_device_ns);
+	clock->jitter_ns = clock->win_max_err_ns -
+			   (clock->win_host_ns - estimate);
+	clock->ref_host_ns =
+		estimate + div_s64(clock->win_host_ns - estimate,
+				   SB_MIDEX_CLOCK_PHASE_GAIN);
+	clock->ref_device_ns = clock->win_device_ns;
+
+	clock->prev_valid = true;
+	clock->prev_device_ns = clock->win_device_ns;
+	clock->prev_host_ns = clock->win_host_ns;
+	clock->win_samples = 0;
+	clock->windows++;
+}
+
+/*
+ * Converts a MIDEX time counter value, received at host time @now, into
+ * CLOCK_MONOTONIC. Wraps of the counter are resolved with the elapsed host
+ * time, so gaps in the input of more than one wrap period are handled too.
+ */
+static ktime_t sb_midex_clock_to_host(struct sb_midex_clock *clock,
+				      uint16_t count, ktime_t now)
+{
+	u64 delta;
+	u64 elapsed;
+	u64 device_ns;
+	s64 host_ns = ktime_to_ns(now);
+	s64 err;
+
+	count &= SB_MIDEX_CLOCK_COUNTER_MASK;
+	clock->samples++;
+
+	if (!clock->valid) {
+		clock->valid = true;
+		clock->ticks = count;
+		clock->last_count = count;
+		clock->last_host = now;
+		clock->ref_device_ns = (u64)count * SB_MIDEX_CLOCK_TICK_NS;
+		clock->ref_host_ns = host_ns;
+		return now;
+	}
+
+	delta = (count - clock->last_count) & SB_MIDEX_CLOCK_COUNTER_MASK;
+	elapsed = div_u64(ktime_to_ns(ktime_sub(now, clock->last_host)),
+			  SB_MIDEX_CLOCK_TICK_NS);
+	if (elapsed > delta)
+		delta += div_u64(elapsed - delta + SB_MIDEX_CLOCK_COUNTER_WRAP / 2,
+				 SB_MIDEX_CLOCK_COUNTER_WRAP) *
+			 SB_MIDEX_CLOCK_COUNTER_WRAP;
+
+	clock->ticks += delta;
+	clock->last_count = count;
+	clock->last_host = now;
+	device_ns = clock->ticks * SB_MIDEX_CLOCK_TICK_NS;
+
+	err = host_ns - sb_midex_clock_predict(clock, device_ns);
+	if (err < 0) {
+		/* no latency can explain this: the estimate is late */
+		clock->ref_device_ns = device_ns;
+		clock->ref_host_ns = host_ns;
+		err = 0;
+	}
+
+	if (!clock->win_samples) {
+		clock->win_start_ns = device_ns;
+		clock->win_max_err_ns = err;
+	}
+	if (!clock->win_samples ||
+	    err <= clock->win_host_ns -
+			   sb_midex_clock_predict(clock, clock->win_device_ns)) {
+		clock->win_device_ns = device_ns;
+		clock->win_host_ns = host_ns;
+	}
+	clock->win_max_err_ns = max(clock->win_max_err_ns, err);
+	clock->win_samples++;
+
+	if (clock->win_samples >= SB_MIDEX_CLOCK_WINDOW_SAMPLES &&
+	    device_ns - clock->win_start_ns >= SB_MIDEX_CLOCK_WINDOW_NS)
+		sb_midex_clock_window(clock);
+
+	return ns_to_ktime(sb_midex_clock_predict(clock, device_ns));
+}
+
 /******************************************************************************
  * MIDI stream open/close functions
  ******************************************************************************/
-static int
-sb_midex_raw_midi_substream_open(struct snd_rawmidi_substream *substream)
+
+/*
+ * Registers a user of the device (a substream or sequencer port), and starts
+ * the timing (and with that, MIDI input) for the first one.
+ */
+static void sb_midex_device_use(struct sb_midex *midex)
 {
 	unsigned long flags;
-	struct sb_midex *midex = substream->rmidi->private_data;
 
 	spin_lock_irqsave(&midex->timer_timing_lock, flags);
 
 	midex->num_used_substreams++;
 
 	if (midex->num_used_substreams > 0 &&
-	    midex->timing_state == SB_MIDEX_TIMING_IDLE) {
-		midex->timing_state = SB_MIDEX_TIMING_START;
+	    midex->timing_state == SB_MIDEX_TIMING_IDLE &&
+	    !midex->timer_timing_gone) {
+		WRITE_ONCE(midex->timing_state, SB_MIDEX_TIMING_START);
 		spin_unlock_irqrestore(&midex->timer_timing_lock, flags);
 
 		/*
 		 * some programs start sending right after opening,
 		 * and we need to have sent the timing start message before that
 		 */
-		sb_midex_timer_timing_callback(&midex->timer_timing);
+		sb_midex_timing_tick(midex);
+		sb_midex_timer_timing_wake(midex);
 	} else {
 		spin_unlock_irqrestore(&midex->timer_timing_lock, flags);
 	}
-
-	return 0;
 }
 
-static int
-sb_midex_raw_midi_substream_close(struct snd_rawmidi_substream *substream)
+static void sb_midex_device_unuse(struct sb_midex *midex)
 {
 	unsigned long flags;
-	struct sb_midex *midex = substream->rmidi->private_data;
 
 	spin_lock_irqsave(&midex->timer_timing_lock, flags);
 
@@ -368,19 +1332,55 @@ sb_midex_raw_midi_substream_close(struct snd_rawmidi_substream *substream)
 
 	if (midex->num_used_substreams <= 0 &&
 	    midex->timing_state != SB_MIDEX_TIMING_IDLE)
-		midex->timing_state = SB_MIDEX_TIMING_STOP;
+		WRITE_ONCE(midex->timing_state, SB_MIDEX_TIMING_STOP);
 	spin_unlock_irqrestore(&midex->timer_timing_lock, flags);
-
-	return 0;
 }
 
-/******************************************************************************
- * MIDI input functions
- ******************************************************************************/
-
-static int sb_midex_raw_midi_input_open(struct snd_rawmidi_substream *substream)
-{
-	return sb_midex_raw_midi_substream_open(substream);
+/*
+ * Sets the substream of the port, NULL while it is closed. The output
+ * endpoint uses it under its lock, the input completion with READ_ONCE.
+ */
+static void
+sb_midex_raw_midi_substream_publish(struct snd_rawmidi_substream *substream,
+				    struct snd_rawmidi_substream *value)
+{
+	struct sb_midex *midex = substream->rmidi->private_data;
+	struct sb_midex_endpoint *ep;
+	unsigned long flags;
+
+	if (substream->stream == SNDRV_RAWMIDI_STREAM_INPUT)
+		ep = &midex->midi_in;
+	else
+		ep = &midex->midi_out;
+
+	spin_lock_irqsave(&ep->lock, flags);
+	WRITE_ONCE(ep->ports[substream->number].substream, value);
+	spin_unlock_irqrestore(&ep->lock, flags);
+}
+
+static int
+sb_midex_raw_midi_substream_open(struct snd_rawmidi_substream *substream)
+{
+	sb_midex_raw_midi_substream_publish(substream, substream);
+	sb_midex_device_use(substream->rmidi->private_data);
+	return 0;
+}
+
+static int
+sb_midex_raw_midi_substream_close(struct snd_rawmidi_substream *substream)
+{
+	sb_midex_raw_midi_substream_publish(substream, NULL);
+	sb_midex_device_unuse(substream->rmidi->private_data);
+	return 0;
+}
+
+/******************************************************************************
+ * MIDI input functions
+ ******************************************************************************/
+
+static int sb_midex_raw_midi_input_open(struct snd_rawmidi_substream *substream)
+{
+	return sb_midex_raw_midi_substream_open(substream);
 }
 
 static int
@@ -394,70 +1394,1531 @@ sb_midex_raw_midi_input_trigger(struct snd_rawmidi_substream *substream, int up)
 {
 	struct sb_midex *midex = substream->rmidi->private_data;
 
-	midex->midi_in.last_active_port = substream->number;
-	midex->midi_in.ports[substream->number].triggered = up;
+	WRITE_ONCE(midex->midi_in.ports[substream->number].triggered, up);
+}
+
+/******************************************************************************
+ * MIDI output functions
+ ******************************************************************************/
+
+/*
+ * Forgets a SysEx (or any message) a previous user of the port left open,
+ * so the port does not hold back the packets of in-kernel sources for it.
+ */
+static void
+sb_midex_raw_midi_output_reset(struct snd_rawmidi_substream *substream)
+{
+	struct sb_midex *midex = substream->rmidi->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&midex->midi_out.lock, flags);
+	midex->midi_out.ports[substream->number].state = STATE_UNKNOWN;
+	spin_unlock_irqrestore(&midex->midi_out.lock, flags);
+}
+
+static int
+sb_midex_raw_midi_output_open(struct snd_rawmidi_substream *substream)
+{
+	sb_midex_raw_midi_output_reset(substream);
+	return sb_midex_raw_midi_substream_open(substream);
+}
+
+static int
+sb_midex_raw_midi_output_close(struct snd_rawmidi_substream *substream)
+{
+	int ret = sb_midex_raw_midi_substream_close(substream);
+
+	sb_midex_raw_midi_output_reset(substream);
+	return ret;
+}
+
+static void
+sb_midex_raw_midi_output_trigger(struct snd_rawmidi_substream *substream,
+				 int up)
+{
+	struct sb_midex *midex = substream->rmidi->private_data;
+
+	midex->midi_out.ports[substream->number].triggered = up;
+
+	if (up)
+		sb_midex_usb_midi_output_kick(midex);
+}
+
+static struct snd_rawmidi_ops sb_midex_raw_midi_output = {
+	.open = sb_midex_raw_midi_output_open,
+	.close = sb_midex_raw_midi_output_close,
+	.trigger = sb_midex_raw_midi_output_trigger,
+	.drain = sb_midex_usb_midi_output_drain,
+};
+
+static struct snd_rawmidi_ops sb_midex_raw_midi_input = {
+	.open = sb_midex_raw_midi_input_open,
+	.close = sb_midex_raw_midi_input_close,
+	.trigger = sb_midex_raw_midi_input_trigger,
+};
+
+/******************************************************************************
+ * USB MIDI packet functions
+ ******************************************************************************/
+
+/*
+ * Packs one SysEx byte. Returns true when @packet is complete: [P4 XX XX XX],
+ * or [P5..P7 ...] at the end of the message. Bytes outside a SysEx message
+ * are dropped.
+ */
+static bool sb_midex_sysex_pack(struct sb_midex_sysex_packer *packer,
+				uint8_t port, uint8_t b,
+				struct sb_midex_packet *packet)
+{
+	if (b == 0xf0) {
+		packer->active = true;
+		packer->len = 0;
+	} else if (!packer->active) {
+		return false;
+	}
+
+	packer->data[packer->len++] = b;
+	if (b != 0xf7 && packer->len < 3)
+		return false;
+
+	packet->data[0] = (port << 4) | (b == 0xf7 ? 0x04 + packer->len : 0x04);
+	packet->data[1] = packer->data[0];
+	packet->data[2] = packer->len > 1 ? packer->data[1] : 0;
+	packet->data[3] = packer->len > 2 ? packer->data[2] : 0;
+	packer->len = 0;
+	if (b == 0xf7)
+		packer->active = false;
+
+	return true;
+}
+
+/******************************************************************************
+ * Sequencer client functions
+ ******************************************************************************/
+#if IS_ENABLED(CONFIG_SND_SEQUENCER)
+
+/*
+ * Sends @ev to the subscribers, with the device time of the message as its
+ * real time stamp (CLOCK_MONOTONIC). Subscriptions with a queue time stamp
+ * get it replaced by the sequencer core.
+ */
+static void sb_midex_seq_dispatch(struct sb_midex_seq_port *port,
+				  struct snd_seq_event *ev, ktime_t tstamp)
+{
+	struct timespec64 ts = ktime_to_timespec64(tstamp);
+
+	ev->flags &= ~SNDRV_SEQ_TIME_MODE_MASK;
+	ev->flags |= SNDRV_SEQ_TIME_STAMP_REAL;
+	ev->time.time.tv_sec = ts.tv_sec;
+	ev->time.time.tv_nsec = ts.tv_nsec;
+	ev->source.port = port->number;
+	snd_seq_ev_set_subs(ev);
+	snd_seq_ev_set_direct(ev);
+	snd_seq_kernel_client_dispatch(port->midex->seq.client, ev, 1, 0);
+}
+
+static void sb_midex_seq_dispatch_sysex(struct sb_midex_seq_port *port)
+{
+	struct snd_seq_event ev;
+
+	if (!port->sysex_in_len)
+		return;
+
+	snd_seq_ev_clear(&ev);
+	snd_seq_ev_set_sysex(&ev, port->sysex_in_len, port->sysex_in);
+	sb_midex_seq_dispatch(port, &ev, port->sysex_in_tstamp);
+	port->sysex_in_len = 0;
+}
+
+/*
+ * Converts a (non-SysEx) MIDI message into a sequencer event.
+ * Returns false for messages without an event type.
+ */
+static bool sb_midex_seq_decode(const uint8_t *msg, struct snd_seq_event *ev)
+{
+	snd_seq_ev_clear(ev);
+
+	switch (msg[0] & 0xf0) {
+	case 0x80:
+	case 0x90:
+	case 0xa0:
+		ev->type = (msg[0] & 0xf0) == 0x80 ? SNDRV_SEQ_EVENT_NOTEOFF :
+			   (msg[0] & 0xf0) == 0x90 ? SNDRV_SEQ_EVENT_NOTEON :
+						     SNDRV_SEQ_EVENT_KEYPRESS;
+		ev->data.note.channel = msg[0] & 0x0f;
+		ev->data.note.note = msg[1];
+		ev->data.note.velocity = msg[2];
+		return true;
+	case 0xb0:
+		ev->type = SNDRV_SEQ_EVENT_CONTROLLER;
+		ev->data.control.channel = msg[0] & 0x0f;
+		ev->data.control.param = msg[1];
+		ev->data.control.value = msg[2];
+		return true;
+	case 0xc0:
+	case 0xd0:
+		ev->type = (msg[0] & 0xf0) == 0xc0 ? SNDRV_SEQ_EVENT_PGMCHANGE :
+						     SNDRV_SEQ_EVENT_CHANPRESS;
+		ev->data.control.channel = msg[0] & 0x0f;
+		ev->data.control.value = msg[1];
+		return true;
+	case 0xe0:
+		ev->type = SNDRV_SEQ_EVENT_PITCHBEND;
+		ev->data.control.channel = msg[0] & 0x0f;
+		ev->data.control.value = (msg[1] | (msg[2] << 7)) - 8192;
+		return true;
+	}
+
+	switch (msg[0]) {
+	case 0xf1:
+		ev->type = SNDRV_SEQ_EVENT_QFRAME;
+		ev->data.control.value = msg[1];
+		return true;
+	case 0xf2:
+		ev->type = SNDRV_SEQ_EVENT_SONGPOS;
+		ev->data.control.value = msg[1] | (msg[2] << 7);
+		return true;
+	case 0xf3:
+		ev->type = SNDRV_SEQ_EVENT_SONGSEL;
+		ev->data.control.value = msg[1];
+		return true;
+	case 0xf6:
+		ev->type = SNDRV_SEQ_EVENT_TUNE_REQUEST;
+		return true;
+	case 0xf8:
+		ev->type = SNDRV_SEQ_EVENT_CLOCK;
+		return true;
+	case 0xfa:
+		ev->type = SNDRV_SEQ_EVENT_START;
+		return true;
+	case 0xfb:
+		ev->type = SNDRV_SEQ_EVENT_CONTINUE;
+		return true;
+	case 0xfc:
+		ev->type = SNDRV_SEQ_EVENT_STOP;
+		return true;
+	case 0xfe:
+		ev->type = SNDRV_SEQ_EVENT_SENSING;
+		return true;
+	case 0xff:
+		ev->type = SNDRV_SEQ_EVENT_RESET;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Converts received packets of one port, received or time stamped by the
+ * device at @tstamp, straight into sequencer events.
+ * SysEx is collected and dispatched per URB, or when it ends.
+ */
+static void sb_midex_seq_input(struct sb_midex *midex, const uint8_t *packets,
+			       unsigned int num_packets, ktime_t tstamp)
+{
+	struct sb_midex_seq_port *port;
+	struct snd_seq_event ev;
+	unsigned int cin;
+	unsigned int len;
+
+	if (midex->seq.client < 0)
+		return;
+
+	port = &midex->seq.ports[(packets[0] >> 4) & 0x07];
+	if (!atomic_read(&port->subscribers))
+		return;
+
+	for (; num_packets; num_packets--, packets += 4) {
+		cin = packets[0] & 0x0f;
+
+		if (cin >= 0x04 && cin <= 0x07 &&
+		    (cin != 0x05 || packets[1] == 0xf7)) {
+			/* SysEx start/continue (4) or end (5, 6, 7) */
+			len = (cin == 0x04) ? 3 : cin - 0x04;
+			if (port->sysex_in_len + len > sizeof(port->sysex_in))
+				sb_midex_seq_dispatch_sysex(port);
+			if (!port->sysex_in_len)
+				port->sysex_in_tstamp = tstamp;
+			memcpy(&port->sysex_in[port->sysex_in_len], &packets[1],
+			       len);
+			port->sysex_in_len += len;
+			if (cin != 0x04)
+				sb_midex_seq_dispatch_sysex(port);
+			continue;
+		}
+
+		if (sb_midex_seq_decode(&packets[1], &ev))
+			sb_midex_seq_dispatch(port, &ev, tstamp);
+	}
+}
+
+static void sb_midex_seq_input_flush(struct sb_midex *midex)
+{
+	int port_index;
+
+	if (midex->seq.client < 0)
+		return;
+
+	for (port_index = 0; port_index < midex->midi_in.num_ports;
+	     ++port_index)
+		sb_midex_seq_dispatch_sysex(&midex->seq.ports[port_index]);
+}
+
+static void sb_midex_seq_output_packet(struct sb_midex_seq_port *port,
+				       uint8_t cin, uint8_t p1, uint8_t p2,
+				       uint8_t p3)
+{
+	sb_midex_usb_midi_output_queue_packet(port->midex,
+					      (port->number << 4) | cin, p1,
+					      p2, p3);
+}
+
+static void sb_midex_seq_output_cc(struct sb_midex_seq_port *port,
+				   uint8_t channel, uint8_t param,
+				   uint8_t value)
+{
+	sb_midex_seq_output_packet(port, 0x0b, 0xb0 | channel, param & 0x7f,
+				   value & 0x7f);
+}
+
+/*
+ * Packs SysEx bytes of a sequencer event into [P4..P7] packets. The packer
+ * is guarded by the midi_out lock, as events of a port may be delivered
+ * from more than one context.
+ */
+static int sb_midex_seq_output_sysex(void *ptr, void *buf, int count)
+{
+	struct sb_midex_seq_port *port = ptr;
+	struct sb_midex *midex = port->midex;
+	const uint8_t *data = buf;
+	struct sb_midex_packet packet;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&midex->midi_out.lock, flags);
+	for (i = 0; i < count; i++) {
+		if (sb_midex_sysex_pack(&port->sysex_out, port->number, data[i],
+					&packet))
+			sb_midex_usb_midi_output_queue_locked(midex, &packet);
+	}
+	spin_unlock_irqrestore(&midex->midi_out.lock, flags);
+
+	return 0;
+}
+
+/*
+ * Encodes an event written to a MIDEX sequencer port straight into USB MIDI
+ * packets.
+ */
+static int sb_midex_seq_event_input(struct snd_seq_event *ev, int direct,
+				    void *private_data, int atomic, int hop)
+{
+	struct sb_midex_seq_port *port = private_data;
+	struct sb_midex *midex = port->midex;
+	uint8_t ch = ev->data.control.channel & 0x0f;
+	int value = ev->data.control.value;
+	unsigned int param = ev->data.control.param;
+
+	switch (ev->type) {
+	case SNDRV_SEQ_EVENT_NOTEON:
+		sb_midex_seq_output_packet(port, 0x09, 0x90 | ch,
+					   ev->data.note.note & 0x7f,
+					   ev->data.note.velocity & 0x7f);
+		break;
+	case SNDRV_SEQ_EVENT_NOTEOFF:
+		sb_midex_seq_output_packet(port, 0x08, 0x80 | ch,
+					   ev->data.note.note & 0x7f,
+					   ev->data.note.velocity & 0x7f);
+		break;
+	case SNDRV_SEQ_EVENT_KEYPRESS:
+		sb_midex_seq_output_packet(port, 0x0a, 0xa0 | ch,
+					   ev->data.note.note & 0x7f,
+					   ev->data.note.velocity & 0x7f);
+		break;
+	case SNDRV_SEQ_EVENT_CONTROLLER:
+		sb_midex_seq_output_cc(port, ch, param, value);
+		break;
+	case SNDRV_SEQ_EVENT_PGMCHANGE:
+		sb_midex_seq_output_packet(port, 0x0c, 0xc0 | ch, value & 0x7f,
+					   0);
+		break;
+	case SNDRV_SEQ_EVENT_CHANPRESS:
+		sb_midex_seq_output_packet(port, 0x0d, 0xd0 | ch, value & 0x7f,
+					   0);
+		break;
+	case SNDRV_SEQ_EVENT_PITCHBEND:
+		value += 8192;
+		sb_midex_seq_output_packet(port, 0x0e, 0xe0 | ch, value & 0x7f,
+					   (value >> 7) & 0x7f);
+		break;
+	case SNDRV_SEQ_EVENT_CONTROL14:
+		if (param < 32) {
+			sb_midex_seq_output_cc(port, ch, param, value >> 7);
+			sb_midex_seq_output_cc(port, ch, param + 32, value);
+		} else {
+			sb_midex_seq_output_cc(port, ch, param, value);
+		}
+		break;
+	case SNDRV_SEQ_EVENT_NONREGPARAM:
+	case SNDRV_SEQ_EVENT_REGPARAM:
+		/* NRPN: CC 99/98, RPN: CC 101/100, then data entry 6/38 */
+		param = (ev->type == SNDRV_SEQ_EVENT_NONREGPARAM) ? 99 : 101;
+		sb_midex_seq_output_cc(port, ch, param,
+				       ev->data.control.param >> 7);
+		sb_midex_seq_output_cc(port, ch, param - 1,
+				       ev->data.control.param);
+		sb_midex_seq_output_cc(port, ch, 6, value >> 7);
+		sb_midex_seq_output_cc(port, ch, 38, value);
+		break;
+	case SNDRV_SEQ_EVENT_QFRAME:
+		sb_midex_seq_output_packet(port, 0x02, 0xf1, value & 0x7f, 0);
+		break;
+	case SNDRV_SEQ_EVENT_SONGPOS:
+		sb_midex_seq_output_packet(port, 0x03, 0xf2, value & 0x7f,
+					   (value >> 7) & 0x7f);
+		break;
+	case SNDRV_SEQ_EVENT_SONGSEL:
+		sb_midex_seq_output_packet(port, 0x02, 0xf3, value & 0x7f, 0);
+		break;
+	case SNDRV_SEQ_EVENT_TUNE_REQUEST:
+		sb_midex_seq_output_packet(port, 0x05, 0xf6, 0, 0);
+		break;
+	case SNDRV_SEQ_EVENT_CLOCK:
+		sb_midex_seq_output_packet(port, 0x0f, 0xf8, 0, 0);
+		break;
+	case SNDRV_SEQ_EVENT_START:
+		sb_midex_seq_output_packet(port, 0x0f, 0xfa, 0, 0);
+		break;
+	case SNDRV_SEQ_EVENT_CONTINUE:
+		sb_midex_seq_output_packet(port, 0x0f, 0xfb, 0, 0);
+		break;
+	case SNDRV_SEQ_EVENT_STOP:
+		sb_midex_seq_output_packet(port, 0x0f, 0xfc, 0, 0);
+		break;
+	case SNDRV_SEQ_EVENT_SENSING:
+		sb_midex_seq_output_packet(port, 0x0f, 0xfe, 0, 0);
+		break;
+	case SNDRV_SEQ_EVENT_RESET:
+		sb_midex_seq_output_packet(port, 0x0f, 0xff, 0, 0);
+		break;
+	case SNDRV_SEQ_EVENT_SYSEX:
+		if (snd_seq_ev_is_variable(ev))
+			snd_seq_dump_var_event(ev, sb_midex_seq_output_sysex,
+					       port);
+		break;
+	default:
+		return 0;
+	}
+
+	sb_midex_usb_midi_output_kick(midex);
+	return 0;
+}
+
+static int sb_midex_seq_subscribe(void *private_data,
+				  struct snd_seq_port_subscribe *info)
+{
+	struct sb_midex_seq_port *port = private_data;
+
+	atomic_inc(&port->subscribers);
+	sb_midex_device_use(port->midex);
+	return 0;
+}
+
+static int sb_midex_seq_unsubscribe(void *private_data,
+				    struct snd_seq_port_subscribe *info)
+{
+	struct sb_midex_seq_port *port = private_data;
+
+	atomic_dec(&port->subscribers);
+	sb_midex_device_unuse(port->midex);
+	return 0;
+}
+
+static int sb_midex_seq_use(void *private_data,
+			    struct snd_seq_port_subscribe *info)
+{
+	struct sb_midex_seq_port *port = private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->midex->midi_out.lock, flags);
+	port->sysex_out.active = false;
+	spin_unlock_irqrestore(&port->midex->midi_out.lock, flags);
+	sb_midex_device_use(port->midex);
+	return 0;
+}
+
+static int sb_midex_seq_unuse(void *private_data,
+			      struct snd_seq_port_subscribe *info)
+{
+	struct sb_midex_seq_port *port = private_data;
+
+	sb_midex_device_unuse(port->midex);
+	return 0;
+}
+
+/**
+ * Registers the sequencer client, with a port for every MIDEX port
+ */
+static int sb_midex_init_seq(struct sb_midex *midex)
+{
+	struct snd_seq_port_callback callbacks;
+	struct snd_seq_port_info *pinfo;
+	int num_ports = max(midex->midi_in.num_ports,
+			    midex->midi_out.num_ports);
+	int port_index;
+	int err = 0;
+
+	midex->seq.client = -1;
+	if (!seq_client || num_ports == 0)
+		return 0;
+
+	pinfo = kzalloc(sizeof(*pinfo), GFP_KERNEL);
+	if (!pinfo)
+		return -ENOMEM;
+
+	midex->seq.client = snd_seq_create_kernel_client(
+		midex->card, 0, "%s", midex->card->shortname);
+	if (midex->seq.client < 0) {
+		err = midex->seq.client;
+		goto init_seq_error;
+	}
+
+	for (port_index = 0; port_index < num_ports; ++port_index) {
+		struct sb_midex_seq_port *port = &midex->seq.ports[port_index];
+
+		port->midex = midex;
+		port->number = port_index;
+		atomic_set(&port->subscribers, 0);
+
+		memset(pinfo, 0, sizeof(*pinfo));
+		pinfo->addr.client = midex->seq.client;
+		pinfo->addr.port = port_index;
+		pinfo->flags = SNDRV_SEQ_PORT_FLG_GIVEN_PORT;
+		snprintf(pinfo->name, sizeof(pinfo->name), "MIDEX Port %d",
+			 port_index + 1);
+		if (port_index < midex->midi_in.num_ports)
+			pinfo->capability |= SNDRV_SEQ_PORT_CAP_READ |
+					     SNDRV_SEQ_PORT_CAP_SUBS_READ;
+		if (port_index < midex->midi_out.num_ports)
+			pinfo->capability |= SNDRV_SEQ_PORT_CAP_WRITE |
+					     SNDRV_SEQ_PORT_CAP_SUBS_WRITE;
+		if ((pinfo->capability & SNDRV_SEQ_PORT_CAP_READ) &&
+		    (pinfo->capability & SNDRV_SEQ_PORT_CAP_WRITE))
+			pinfo->capability |= SNDRV_SEQ_PORT_CAP_DUPLEX;
+		pinfo->type = SNDRV_SEQ_PORT_TYPE_MIDI_GENERIC |
+			      SNDRV_SEQ_PORT_TYPE_HARDWARE |
+			      SNDRV_SEQ_PORT_TYPE_PORT;
+		pinfo->midi_channels = 16;
+
+		memset(&callbacks, 0, sizeof(callbacks));
+		callbacks.owner = THIS_MODULE;
+		callbacks.private_data = port;
+		if (port_index < midex->midi_in.num_ports) {
+			callbacks.subscribe = sb_midex_seq_subscribe;
+			callbacks.unsubscribe = sb_midex_seq_unsubscribe;
+		}
+		if (port_index < midex->midi_out.num_ports) {
+			callbacks.use = sb_midex_seq_use;
+			callbacks.unuse = sb_midex_seq_unuse;
+			callbacks.event_input = sb_midex_seq_event_input;
+		}
+		pinfo->kernel = &callbacks;
+
+		err = snd_seq_kernel_client_ctl(midex->seq.client,
+						SNDRV_SEQ_IOCTL_CREATE_PORT,
+						pinfo);
+		if (err < 0)
+			goto init_seq_error;
+	}
+
+	kfree(pinfo);
+	return 0;
+
+init_seq_error:
+	dev_err(&midex->usbdev->dev,
+		SB_MIDEX_PREFIX "could not create sequencer client: %d\n", err);
+	if (midex->seq.client >= 0)
+		snd_seq_delete_kernel_client(midex->seq.client);
+	midex->seq.client = -1;
+	kfree(pinfo);
+	return err;
+}
+
+static void sb_midex_free_seq(struct sb_midex *midex)
+{
+	if (midex->seq.client >= 0)
+		snd_seq_delete_kernel_client(midex->seq.client);
+	midex->seq.client = -1;
+}
+#else
+static int sb_midex_init_seq(struct sb_midex *midex)
+{
+	return 0;
+}
+
+static void sb_midex_free_seq(struct sb_midex *midex)
+{
+}
+#endif
+
+/******************************************************************************
+ * UMP endpoint functions
+ ******************************************************************************/
+#ifdef SB_MIDEX_HAVE_UMP
+
+/*
+ * Converts received packets into MIDI 1.0 UMP words: the port nibble becomes
+ * the group, and the message bytes are copied as they are. SysEx becomes
+ * SysEx7 (MT 3) packets of up to 3 bytes each.
+ */
+static void sb_midex_ump_input(struct sb_midex *midex, const uint8_t *packets,
+			       unsigned int num_packets)
+{
+	struct sb_midex_ump *ump = &midex->ump;
+	const uint8_t *data;
+	unsigned int cin;
+	unsigned int len;
+	unsigned int status;
+	u32 word;
+
+	if (!ump->ep || !READ_ONCE(ump->in_active))
+		return;
+
+	for (; num_packets; num_packets--, packets += 4) {
+		if (ump->in_len + 2 > ARRAY_SIZE(ump->in_words))
+			sb_midex_ump_input_flush(midex);
+
+		cin = packets[0] & 0x0f;
+		word = (((packets[0] >> 4) & 0x07) << 24) | (packets[1] << 16) |
+		       (packets[2] << 8) | packets[3];
+
+		if (cin >= 0x08 && cin <= 0x0e) {
+			/* channel voice message */
+			ump->in_words[ump->in_len++] = (0x2U << 28) | word;
+			continue;
+		}
+
+		if (cin < 0x04 || cin == 0x0f ||
+		    (cin == 0x05 && packets[1] != 0xf7)) {
+			/* system common or realtime message */
+			ump->in_words[ump->in_len++] = (0x1U << 28) | word;
+			continue;
+		}
+
+		/* SysEx, without the F0 and F7 */
+		data = &packets[1];
+		len = (cin == 0x04) ? 3 : cin - 0x04;
+		if (data[0] == 0xf0) {
+			data++;
+			len--;
+			status = (cin == 0x04) ? 0x1 : 0x0; /* start/complete */
+		} else {
+			status = (cin == 0x04) ? 0x2 : 0x3; /* continue/end */
+		}
+		if (cin != 0x04)
+			len--;
+
+		ump->in_words[ump->in_len++] =
+			(0x3U << 28) | (word & 0x0f000000) | (status << 20) |
+			(len << 16) | ((len > 0 ? data[0] : 0) << 8) |
+			(len > 1 ? data[1] : 0);
+		ump->in_words[ump->in_len++] = (u32)(len > 2 ? data[2] : 0)
+					       << 24;
+	}
+}
+
+static void sb_midex_ump_input_flush(struct sb_midex *midex)
+{
+	struct sb_midex_ump *ump = &midex->ump;
+
+	if (!ump->in_len)
+		return;
+
+	snd_ump_receive(ump->ep, ump->in_words, ump->in_len * 4);
+	ump->in_len = 0;
+}
+
+/* Returns the CIN of a system message, or 0 if it cannot be sent */
+static uint8_t sb_midex_ump_system_cin(uint8_t status)
+{
+	if (status >= 0xf8)
+		return 0x0f;
+
+	switch (status) {
+	case 0xf1:
+	case 0xf3:
+		return 0x02;
+	case 0xf2:
+		return 0x03;
+	case 0xf6:
+		return 0x05;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Moves UMP packets written by applications into the urb. Channel voice
+ * and system messages map 1:1 onto a packet, SysEx7 is repacked. MIDI 2.0,
+ * utility and stream messages have no MIDEX equivalent and are dropped.
+ * A packet for a paced port is held back, and with it the rest of the
+ * stream, as the UMP buffer can only be consumed in order.
+ * Called with the midi_out lock held.
+ */
+static void sb_midex_ump_output(struct sb_midex *midex, struct urb *urb,
+				ktime_t now, ktime_t *wake)
+{
+	struct sb_midex_ump *ump = &midex->ump;
+	struct sb_midex_packet packet;
+	u32 *words = ump->out_words;
+	uint8_t sysex[8];
+	unsigned int group;
+	unsigned int num_bytes;
+	unsigned int i;
+	unsigned int from;
+	uint8_t status;
+	uint8_t cin;
+
+	if (!ump->ep || (!ump->out_active && !ump->out_len))
+		return;
+
+	/* a UMP packet becomes 3 packets at most */
+	while (urb->transfer_buffer_length + 12 <= midex->midi_out_max_len) {
+		if (!ump->out_len) {
+			ump->out_len = snd_ump_transmit(ump->ep, ump->out_words,
+							sizeof(ump->out_words));
+			if (ump->out_len <= 0) {
+				ump->out_len = 0;
+				ump->out_active = false;
+				break;
+			}
+		}
+
+		group = (words[0] >> 24) & 0x0f;
+		status = (words[0] >> 16) & 0xff;
+		if (group < midex->midi_out.num_ports &&
+		    !((words[0] >> 28) == 0x1 && status >= 0xf8) &&
+		    sb_midex_usb_midi_output_paced(
+			    &midex->midi_out.ports[group], now, wake))
+			break;
+
+		ump->out_len = 0;
+		if (group >= midex->midi_out.num_ports)
+			continue;
+		from = urb->transfer_buffer_length;
+
+		switch (words[0] >> 28) {
+		case 0x1: /* system common and realtime */
+			cin = sb_midex_ump_system_cin(status);
+			if (status >= 0xf8)
+				sb_midex_usb_midi_output_queue_rt(midex, group,
+								  status);
+			else if (cin)
+				sb_midex_usb_midi_output_packet(
+					urb, (group << 4) | cin, status,
+					(words[0] >> 8) & 0x7f,
+					words[0] & 0x7f);
+			break;
+		case 0x2: /* MIDI 1.0 channel voice */
+			sb_midex_usb_midi_output_packet(
+				urb, (group << 4) | (status >> 4), status,
+				(words[0] >> 8) & 0x7f, words[0] & 0x7f);
+			break;
+		case 0x3: /* SysEx7 */
+			num_bytes = 0;
+			if ((status >> 4) <= 0x1) /* complete, start */
+				sysex[num_bytes++] = 0xf0;
+			for (i = 0; i < min(status & 0x0fU, 6U); i++)
+				sysex[num_bytes++] =
+					(words[(i + 2) / 4] >>
+					 (24 - 8 * ((i + 2) % 4))) & 0x7f;
+			if ((status >> 4) == 0x0 || (status >> 4) == 0x3)
+				sysex[num_bytes++] = 0xf7;
+
+			for (i = 0; i < num_bytes; i++) {
+				if (sb_midex_sysex_pack(&ump->sysex_out[group],
+							group, sysex[i],
+							&packet))
+					sb_midex_usb_midi_output_packet(
+						urb, packet.data[0],
+						packet.data[1], packet.data[2],
+						packet.data[3]);
+			}
+			break;
+		default:
+			break;
+		}
+		sb_midex_usb_midi_output_pace_charge(midex, urb, from, now);
+	}
+}
+
+static int sb_midex_ump_open(struct snd_ump_endpoint *ep, int dir)
+{
+	struct sb_midex *midex = ep->private_data;
+	int group;
+
+	if (dir == SNDRV_RAWMIDI_STREAM_OUTPUT) {
+		for (group = 0; group < ARRAY_SIZE(midex->ump.sysex_out);
+		     ++group)
+			midex->ump.sysex_out[group].active = false;
+		midex->ump.out_len = 0;
+	}
+
+	sb_midex_device_use(midex);
+	return 0;
+}
+
+static void sb_midex_ump_close(struct snd_ump_endpoint *ep, int dir)
+{
+	struct sb_midex *midex = ep->private_data;
+
+	if (dir == SNDRV_RAWMIDI_STREAM_INPUT)
+		WRITE_ONCE(midex->ump.in_active, false);
+	else
+		WRITE_ONCE(midex->ump.out_active, false);
+
+	sb_midex_device_unuse(midex);
+}
+
+static void sb_midex_ump_trigger(struct snd_ump_endpoint *ep, int dir, int up)
+{
+	struct sb_midex *midex = ep->private_data;
+
+	if (dir == SNDRV_RAWMIDI_STREAM_INPUT) {
+		WRITE_ONCE(midex->ump.in_active, up);
+	} else {
+		WRITE_ONCE(midex->ump.out_active, up);
+		if (up)
+			sb_midex_usb_midi_output_kick(midex);
+	}
+}
+
+static void sb_midex_ump_drain(struct snd_ump_endpoint *ep, int dir)
+{
+	if (dir == SNDRV_RAWMIDI_STREAM_OUTPUT)
+		sb_midex_usb_midi_output_drain_urbs(ep->private_data, 0xff);
+}
+
+static const struct snd_ump_ops sb_midex_ump_ops = {
+	.open = sb_midex_ump_open,
+	.close = sb_midex_ump_close,
+	.trigger = sb_midex_ump_trigger,
+	.drain = sb_midex_ump_drain,
+};
+
+/**
+ * Adds the UMP endpoint (rawmidi device 1), with a MIDI 1.0 function block
+ * for every MIDEX port
+ */
+static int sb_midex_init_ump(struct sb_midex *midex)
+{
+	struct snd_ump_endpoint *ep;
+	struct snd_ump_block *fb;
+	int num_ports = max(midex->midi_in.num_ports,
+			    midex->midi_out.num_ports);
+	int port_index;
+	int direction;
+	int ret;
+
+	if (!ump_endpoint || num_ports == 0)
+		return 0;
+
+	ret = snd_ump_endpoint_new(midex->card, "MIDEX UMP", 1,
+				   midex->midi_out.num_ports > 0,
+				   midex->midi_in.num_ports > 0, &ep);
+	if (ret < 0)
+		return ret;
+
+	ep->private_data = midex;
+	ep->ops = &sb_midex_ump_ops;
+	ep->info.flags = SNDRV_UMP_EP_INFO_STATIC_BLOCKS;
+	ep->info.protocol_caps = SNDRV_UMP_EP_INFO_PROTO_MIDI1;
+	ep->info.protocol = SNDRV_UMP_EP_INFO_PROTO_MIDI1;
+	strscpy(ep->info.name, midex->card->shortname, sizeof(ep->info.name));
+	snprintf(ep->core.name, sizeof(ep->core.name), "%s UMP",
+		 midex->card->shortname);
+
+	for (port_index = 0; port_index < num_ports; ++port_index) {
+		if (port_index >= midex->midi_in.num_ports)
+			direction = SNDRV_UMP_DIR_OUTPUT;
+		else if (port_index >= midex->midi_out.num_ports)
+			direction = SNDRV_UMP_DIR_INPUT;
+		else
+			direction = SNDRV_UMP_DIR_BIDIRECTION;
+
+		ret = snd_ump_block_new(ep, port_index, direction, port_index,
+					1, &fb);
+		if (ret < 0)
+			return ret;
+
+		fb->info.flags |= SNDRV_UMP_BLOCK_IS_MIDI1 |
+				  SNDRV_UMP_BLOCK_IS_LOWSPEED;
+		snprintf(fb->info.name, sizeof(fb->info.name), "MIDEX Port %d",
+			 port_index + 1);
+	}
+
+	midex->ump.ep = ep;
+	return 0;
+}
+#else
+static int sb_midex_init_ump(struct sb_midex *midex)
+{
+	return 0;
+}
+#endif
+
+/******************************************************************************
+ * MIDI clock generator functions
+ ******************************************************************************/
+
+static u64 sb_midex_clock_gen_period(unsigned int tempo)
+{
+	/* 24 clocks per quarter note, tempo in 1/100 BPM */
+	return div_u64(60ULL * 100 * NSEC_PER_SEC, tempo * 24);
+}
+
+/* Sends a real-time byte on every port that has the clock enabled */
+static void sb_midex_clock_gen_send(struct sb_midex *midex, uint8_t b)
+{
+	uint8_t ports = READ_ONCE(midex->clock_gen.ports);
+	unsigned long flags;
+	int port_index;
+
+	if (!ports)
+		return;
+
+	spin_lock_irqsave(&midex->midi_out.lock, flags);
+	for (port_index = 0; port_index < midex->midi_out.num_ports;
+	     ++port_index)
+		if (ports & (1 << port_index))
+			sb_midex_usb_midi_output_queue_rt(midex, port_index, b);
+	spin_unlock_irqrestore(&midex->midi_out.lock, flags);
+
+	sb_midex_usb_midi_output_kick(midex);
+}
+
+/*
+ * Sends a clock tick. The timer is forwarded from its last expiry, so the
+ * ticks do not drift with the callback latency; a new tempo applies from the
+ * next tick on.
+ */
+static enum hrtimer_restart sb_midex_clock_gen_callback(struct hrtimer *hrt)
+{
+	struct sb_midex *midex =
+		container_of(hrt, struct sb_midex, clock_gen.timer);
+
+	sb_midex_clock_gen_send(midex, 0xf8);
+	WRITE_ONCE(midex->clock_gen.ticks, midex->clock_gen.ticks + 1);
+
+	hrtimer_forward_now(hrt, ns_to_ktime(sb_midex_clock_gen_period(
+					 READ_ONCE(midex->clock_gen.tempo))));
+	return HRTIMER_RESTART;
+}
+
+/* Sends MIDI start (0xFA) and runs the clock, or stops it and sends 0xFC */
+static void sb_midex_clock_gen_run(struct sb_midex *midex, bool run)
+{
+	struct sb_midex_clock_gen *clock_gen = &midex->clock_gen;
+
+	if (run) {
+		sb_midex_device_use(midex);
+		clock_gen->ticks = 0;
+		sb_midex_clock_gen_send(midex, 0xfa);
+		hrtimer_start(&clock_gen->timer,
+			      ktime_add_ns(ktime_get(),
+					   sb_midex_clock_gen_period(
+						   clock_gen->tempo)),
+			      HRTIMER_MODE_ABS);
+	} else {
+		hrtimer_cancel(&clock_gen->timer);
+		sb_midex_clock_gen_send(midex, 0xfc);
+		sb_midex_device_unuse(midex);
+	}
+	WRITE_ONCE(clock_gen->running, run);
+}
+
+/******************************************************************************
+ * Control functions
+ ******************************************************************************/
+
+/*
+ * "MIDI Input Realtime Filter", one per input port (the control index):
+ * bit n of the value drops received 0xF8 + n messages before delivery.
+ */
+static int
+sb_midex_control_realtime_filter_info(struct snd_kcontrol *kcontrol,
+				      struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = 0xff;
+	return 0;
+}
+
+static int
+sb_midex_control_realtime_filter_get(struct snd_kcontrol *kcontrol,
+				     struct snd_ctl_elem_value *ucontrol)
+{
+	struct sb_midex *midex = snd_kcontrol_chip(kcontrol);
+	struct sb_midex_port *port =
+		&midex->midi_in.ports[kcontrol->private_value];
+
+	ucontrol->value.integer.value[0] = READ_ONCE(port->realtime_filter);
+	return 0;
+}
+
+static int
+sb_midex_control_realtime_filter_put(struct snd_kcontrol *kcontrol,
+				     struct snd_ctl_elem_value *ucontrol)
+{
+	struct sb_midex *midex = snd_kcontrol_chip(kcontrol);
+	struct sb_midex_port *port =
+		&midex->midi_in.ports[kcontrol->private_value];
+	uint8_t mask = ucontrol->value.integer.value[0] & 0xff;
+
+	if (mask == port->realtime_filter)
+		return 0;
+
+	WRITE_ONCE(port->realtime_filter, mask);
+	return 1;
+}
+
+/* "MIDI Clock Tempo", in 1/100 BPM */
+static int sb_midex_control_clock_tempo_info(struct snd_kcontrol *kcontrol,
+					     struct snd_ctl_elem_info *uinfo)
+{
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = SB_MIDEX_CLOCK_GEN_TEMPO_MIN;
+	uinfo->value.integer.max = SB_MIDEX_CLOCK_GEN_TEMPO_MAX;
+	return 0;
+}
+
+static int sb_midex_control_clock_tempo_get(struct snd_kcontrol *kcontrol,
+					    struct snd_ctl_elem_value *ucontrol)
+{
+	struct sb_midex *midex = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = READ_ONCE(midex->clock_gen.tempo);
+	return 0;
+}
+
+static int sb_midex_control_clock_tempo_put(struct snd_kcontrol *kcontrol,
+					    struct snd_ctl_elem_value *ucontrol)
+{
+	struct sb_midex *midex = snd_kcontrol_chip(kcontrol);
+	long tempo = ucontrol->value.integer.value[0];
+
+	if (tempo < SB_MIDEX_CLOCK_GEN_TEMPO_MIN ||
+	    tempo > SB_MIDEX_CLOCK_GEN_TEMPO_MAX)
+		return -EINVAL;
+	if (tempo == midex->clock_gen.tempo)
+		return 0;
+
+	WRITE_ONCE(midex->clock_gen.tempo, tempo);
+	return 1;
+}
+
+/*
+ * "MIDI Clock Output", one per output port (the control index): the port
+ * sends the clock generator's messages.
+ */
+static int sb_midex_control_clock_output_get(struct snd_kcontrol *kcontrol,
+					     struct snd_ctl_elem_value *ucontrol)
+{
+	struct sb_midex *midex = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] =
+		!!(READ_ONCE(midex->clock_gen.ports) &
+		   (1 << kcontrol->private_value));
+	return 0;
+}
+
+static int sb_midex_control_clock_output_put(struct snd_kcontrol *kcontrol,
+					     struct snd_ctl_elem_value *ucontrol)
+{
+	struct sb_midex *midex = snd_kcontrol_chip(kcontrol);
+	uint8_t ports = midex->clock_gen.ports & ~(1 << kcontrol->private_value);
+
+	if (ucontrol->value.integer.value[0])
+		ports |= 1 << kcontrol->private_value;
+	if (ports == midex->clock_gen.ports)
+		return 0;
+
+	WRITE_ONCE(midex->clock_gen.ports, ports);
+	return 1;
+}
+
+/* "MIDI Clock Run": on sends start and runs the clock, off sends stop */
+static int sb_midex_control_clock_run_get(struct snd_kcontrol *kcontrol,
+					  struct snd_ctl_elem_value *ucontrol)
+{
+	struct sb_midex *midex = snd_kcontrol_chip(kcontrol);
+
+	ucontrol->value.integer.value[0] = READ_ONCE(midex->clock_gen.running);
+	return 0;
+}
+
+static int sb_midex_control_clock_run_put(struct snd_kcontrol *kcontrol,
+					  struct snd_ctl_elem_value *ucontrol)
+{
+	struct sb_midex *midex = snd_kcontrol_chip(kcontrol);
+	bool run = !!ucontrol->value.integer.value[0];
+
+	if (run == midex->clock_gen.running)
+		return 0;
+
+	sb_midex_clock_gen_run(midex, run);
+	return 1;
+}
+
+/*
+ * "MIDI Thru", one per input port (the control index): bit n of the value
+ * copies everything received on the port to output port n.
+ */
+static int sb_midex_control_thru_info(struct snd_kcontrol *kcontrol,
+				      struct snd_ctl_elem_info *uinfo)
+{
+	struct sb_midex *midex = snd_kcontrol_chip(kcontrol);
+
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	uinfo->value.integer.min = 0;
+	uinfo->value.integer.max = (1 << midex->midi_out.num_ports) - 1;
+	return 0;
+}
+
+static int sb_midex_control_thru_get(struct snd_kcontrol *kcontrol,
+				     struct snd_ctl_elem_value *ucontrol)
+{
+	struct sb_midex *midex = snd_kcontrol_chip(kcontrol);
+	struct sb_midex_port *port =
+		&midex->midi_in.ports[kcontrol->private_value];
+
+	ucontrol->value.integer.value[0] = READ_ONCE(port->thru);
+	return 0;
+}
+
+static int sb_midex_control_thru_put(struct snd_kcontrol *kcontrol,
+				     struct snd_ctl_elem_value *ucontrol)
+{
+	struct sb_midex *midex = snd_kcontrol_chip(kcontrol);
+	struct sb_midex_port *port =
+		&midex->midi_in.ports[kcontrol->private_value];
+	uint8_t mask = ucontrol->value.integer.value[0] &
+		       ((1 << midex->midi_out.num_ports) - 1);
+	unsigned long flags;
+	uint8_t was;
+	uint8_t inputs;
+
+	spin_lock_irqsave(&midex->midi_out.lock, flags);
+	if (mask == port->thru) {
+		spin_unlock_irqrestore(&midex->midi_out.lock, flags);
+		return 0;
+	}
+
+	was = midex->midi_thru_inputs;
+	inputs = was;
+	WRITE_ONCE(port->thru, mask);
+	if (mask)
+		inputs |= 1 << kcontrol->private_value;
+	else
+		inputs &= ~(1 << kcontrol->private_value);
+	WRITE_ONCE(midex->midi_thru_inputs, inputs);
+	spin_unlock_irqrestore(&midex->midi_out.lock, flags);
+
+	/* input runs (with the timing) while any thru connection is set */
+	if (!was && inputs)
+		sb_midex_device_use(midex);
+	else if (was && !inputs)
+		sb_midex_device_unuse(midex);
+	return 1;
+}
+
+/**
+ * Adds the card controls
+ */
+static int sb_midex_init_controls(struct sb_midex *midex)
+{
+	struct snd_kcontrol_new realtime_filter = {
+		.iface = SNDRV_CTL_ELEM_IFACE_CARD,
+		.name = "MIDI Input Realtime Filter",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = sb_midex_control_realtime_filter_info,
+		.get = sb_midex_control_realtime_filter_get,
+		.put = sb_midex_control_realtime_filter_put,
+	};
+	struct snd_kcontrol_new thru = {
+		.iface = SNDRV_CTL_ELEM_IFACE_CARD,
+		.name = "MIDI Thru",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = sb_midex_control_thru_info,
+		.get = sb_midex_control_thru_get,
+		.put = sb_midex_control_thru_put,
+	};
+	struct snd_kcontrol_new clock_tempo = {
+		.iface = SNDRV_CTL_ELEM_IFACE_CARD,
+		.name = "MIDI Clock Tempo",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = sb_midex_control_clock_tempo_info,
+		.get = sb_midex_control_clock_tempo_get,
+		.put = sb_midex_control_clock_tempo_put,
+	};
+	struct snd_kcontrol_new clock_output = {
+		.iface = SNDRV_CTL_ELEM_IFACE_CARD,
+		.name = "MIDI Clock Output",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = snd_ctl_boolean_mono_info,
+		.get = sb_midex_control_clock_output_get,
+		.put = sb_midex_control_clock_output_put,
+	};
+	struct snd_kcontrol_new clock_run = {
+		.iface = SNDRV_CTL_ELEM_IFACE_CARD,
+		.name = "MIDI Clock Run",
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = snd_ctl_boolean_mono_info,
+		.get = sb_midex_control_clock_run_get,
+		.put = sb_midex_control_clock_run_put,
+	};
+	int port_index;
+	int ret;
+
+	for (port_index = 0; port_index < midex->midi_in.num_ports;
+	     ++port_index) {
+		midex->midi_in.ports[port_index].realtime_filter =
+			input_realtime_filter & 0xff;
+
+		realtime_filter.index = port_index;
+		realtime_filter.private_value = port_index;
+		ret = snd_ctl_add(midex->card,
+				  snd_ctl_new1(&realtime_filter, midex));
+		if (ret < 0)
+			return ret;
+
+		thru.index = port_index;
+		thru.private_value = port_index;
+		ret = snd_ctl_add(midex->card, snd_ctl_new1(&thru, midex));
+		if (ret < 0)
+			return ret;
+	}
+
+	for (port_index = 0; port_index < midex->midi_out.num_ports;
+	     ++port_index) {
+		clock_output.index = port_index;
+		clock_output.private_value = port_index;
+		ret = snd_ctl_add(midex->card,
+				  snd_ctl_new1(&clock_output, midex));
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = snd_ctl_add(midex->card, snd_ctl_new1(&clock_tempo, midex));
+	if (ret < 0)
+		return ret;
+
+	return snd_ctl_add(midex->card, snd_ctl_new1(&clock_run, midex));
+}
+
+/******************************************************************************
+ * Scheduled output functions
+ ******************************************************************************/
+
+/*
+ * Events with the same deadline are sent in the order they were queued.
+ */
+static bool sb_midex_sched_before(const struct sb_midex_sched_entry *a,
+				  const struct sb_midex_sched_entry *b)
+{
+	if (a->deadline_ns != b->deadline_ns)
+		return a->deadline_ns < b->deadline_ns;
+	return (s32)(a->seq - b->seq) < 0;
+}
+
+/*
+ * Adds @entry to the heap. Returns true if it is the next event now.
+ * Called with the sched lock held, and a free slot.
+ */
+static bool sb_midex_sched_push(struct sb_midex_sched *sched,
+				const struct sb_midex_sched_entry *entry)
+{
+	unsigned int pos = sched->len++;
+	unsigned int parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (!sb_midex_sched_before(entry, &sched->events[parent]))
+			break;
+		sched->events[pos] = sched->events[parent];
+		pos = parent;
+	}
+	sched->events[pos] = *entry;
+
+	return pos == 0;
+}
+
+/*
+ * Removes the next event from the heap.
+ * Called with the sched lock held, and a non empty heap.
+ */
+static void sb_midex_sched_pop(struct sb_midex_sched *sched)
+{
+	const struct sb_midex_sched_entry *last = &sched->events[--sched->len];
+	unsigned int pos = 0;
+	unsigned int child;
+
+	while ((child = 2 * pos + 1) < sched->len) {
+		if (child + 1 < sched->len &&
+		    sb_midex_sched_before(&sched->events[child + 1],
+					  &sched->events[child]))
+			child++;
+		if (!sb_midex_sched_before(&sched->events[child], last))
+			break;
+		sched->events[pos] = sched->events[child];
+		pos = child;
+	}
+	sched->events[pos] = *last;
+}
+
+/*
+ * Moves the events that are due into the output packet queue, and kicks
+ * the output to send them.
+ */
+static enum hrtimer_restart sb_midex_sched_callback(struct hrtimer *hrt)
+{
+	struct sb_midex *midex =
+		container_of(hrt, struct sb_midex, sched.timer);
+	struct sb_midex_sched *sched = &midex->sched;
+	struct sb_midex_sched_entry *event;
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	s64 now = ktime_get_ns();
+	unsigned long flags;
+	unsigned int num_due = 0;
+
+	spin_lock_irqsave(&sched->lock, flags);
+
+	while (sched->len && sched->events[0].deadline_ns <= now) {
+		event = &sched->events[0];
+		if (now - event->deadline_ns > SB_MIDEX_SCHED_LATE_NS)
+			sched->late++;
+		if (sb_midex_usb_midi_output_queue_packet(
+			    midex, event->packet[0], event->packet[1],
+			    event->packet[2], event->packet[3]))
+			sched->sent++;
+		else
+			sched->dropped++;
+		sb_midex_sched_pop(sched);
+		num_due++;
+	}
+
+	if (sched->len) {
+		hrtimer_set_expires(hrt,
+				    ns_to_ktime(sched->events[0].deadline_ns));
+		ret = HRTIMER_RESTART;
+	}
+
+	spin_unlock_irqrestore(&sched->lock, flags);
+
+	if (num_due)
+		sb_midex_usb_midi_output_kick(midex);
+
+	return ret;
+}
+
+/*
+ * Copies events from userspace into the queue, ordered by deadline (events
+ * with the same deadline keep their order).
+ * Returns the number of events queued, or a negative error code.
+ */
+static int sb_midex_sched_queue(struct sb_midex *midex,
+				const struct sb_midex_sched_event __user *events,
+				unsigned int count)
+{
+	struct sb_midex_sched *sched = &midex->sched;
+	struct sb_midex_sched_event event;
+	struct sb_midex_sched_entry entry;
+	unsigned long flags;
+	unsigned int queued;
+
+	for (queued = 0; queued < count; queued++) {
+		if (copy_from_user(&event, &events[queued], sizeof(event)))
+			return queued ? queued : -EFAULT;
+
+		if ((event.packet[0] >> 4) >= midex->midi_out.num_ports ||
+		    !sb_midex_cin_length[event.packet[0] & 0x0f])
+			return queued ? queued : -EINVAL;
+
+		spin_lock_irqsave(&sched->lock, flags);
+
+		if (sched->len >= SB_MIDEX_SCHED_LEN) {
+			spin_unlock_irqrestore(&sched->lock, flags);
+			break;
+		}
+
+		entry.deadline_ns = event.deadline_ns;
+		entry.seq = sched->seq++;
+		memcpy(entry.packet, event.packet, sizeof(entry.packet));
+
+		if (sb_midex_sched_push(sched, &entry))
+			hrtimer_start(&sched->timer,
+				      ns_to_ktime(event.deadline_ns),
+				      HRTIMER_MODE_ABS);
+
+		spin_unlock_irqrestore(&sched->lock, flags);
+	}
+
+	return queued;
+}
+
+static void sb_midex_sched_drop(struct sb_midex *midex)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&midex->sched.lock, flags);
+	midex->sched.len = 0;
+	spin_unlock_irqrestore(&midex->sched.lock, flags);
+}
+
+static int sb_midex_hwdep_open(struct snd_hwdep *hw, struct file *file)
+{
+	sb_midex_device_use(hw->private_data);
+	return 0;
+}
+
+static int sb_midex_hwdep_release(struct snd_hwdep *hw, struct file *file)
+{
+	struct sb_midex *midex = hw->private_data;
+
+	sb_midex_sched_drop(midex);
+	sb_midex_device_unuse(midex);
+	return 0;
+}
+
+static int sb_midex_hwdep_ioctl(struct snd_hwdep *hw, struct file *file,
+				unsigned int cmd, unsigned long arg)
+{
+	struct sb_midex *midex = hw->private_data;
+	struct sb_midex_sched_queue queue;
+	int ret;
+
+	switch (cmd) {
+	case SB_MIDEX_IOCTL_SCHED_QUEUE:
+		if (copy_from_user(&queue, (void __user *)arg, sizeof(queue)))
+			return -EFAULT;
+
+		ret = sb_midex_sched_queue(midex, u64_to_user_ptr(queue.events),
+					   queue.count);
+		if (ret < 0)
+			return ret;
+
+		queue.count = ret;
+		queue.free = SB_MIDEX_SCHED_LEN - READ_ONCE(midex->sched.len);
+		if (copy_to_user((void __user *)arg, &queue, sizeof(queue)))
+			return -EFAULT;
+		return 0;
+	case SB_MIDEX_IOCTL_SCHED_DROP:
+		sb_midex_sched_drop(midex);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/**
+ * Adds the hwdep device for scheduled output, see midex_ioctl.h
+ */
+static int sb_midex_init_hwdep(struct sb_midex *midex)
+{
+	struct snd_hwdep *hw;
+	int ret;
+
+	if (midex->midi_out.num_ports == 0)
+		return 0;
+
+	ret = snd_hwdep_new(midex->card, "MIDEX", 0, &hw);
+	if (ret < 0)
+		return ret;
+
+	strscpy(hw->name, "MIDEX Scheduled Output", sizeof(hw->name));
+	hw->private_data = midex;
+	hw->exclusive = 1;
+	hw->ops.open = sb_midex_hwdep_open;
+	hw->ops.release = sb_midex_hwdep_release;
+	hw->ops.ioctl = sb_midex_hwdep_ioctl;
+	hw->ops.ioctl_compat = sb_midex_hwdep_ioctl;
+
+	return 0;
 }
 
 /******************************************************************************
- * MIDI output functions
+ * USB functions
  ******************************************************************************/
 
-static int
-sb_midex_raw_midi_output_open(struct snd_rawmidi_substream *substream)
+/* Claims and submits an input urb; -EBUSY if it is in use */
+static int sb_midex_usb_midi_input_submit(struct sb_midex *midex,
+					  struct sb_midex_urb_ctx *ctx,
+					  const char *function)
 {
-	return sb_midex_raw_midi_substream_open(substream);
-}
+	int err;
 
-static int
-sb_midex_raw_midi_output_close(struct snd_rawmidi_substream *substream)
-{
-	return sb_midex_raw_midi_substream_close(substream);
+	if (!sb_midex_urb_claim(ctx))
+		return -EBUSY;
+
+	err = sb_midex_submit_urb(ctx, GFP_ATOMIC, function);
+	if (err >= 0)
+		atomic_inc(&midex->midi_in_pool.in_flight);
+	return err;
 }
 
-static void
-sb_midex_raw_midi_output_trigger(struct snd_rawmidi_substream *substream,
-				 int up)
+/*
+ * Submits idle input urbs until the pool's depth is reached.
+ */
+static void sb_midex_usb_midi_input_fill(struct sb_midex *midex)
 {
-	struct sb_midex *midex = substream->rmidi->private_data;
-
-	midex->midi_out.last_active_port = substream->number;
-	midex->midi_out.ports[substream->number].triggered = up;
+	struct sb_midex_in_pool *pool = &midex->midi_in_pool;
+	int urb_index;
 
-	if (up)
-		tasklet_schedule(&midex->midi_out_tasklet);
+	for (urb_index = 0; urb_index < SB_MIDEX_NUM_IN_URBS_MAX &&
+			    atomic_read(&pool->in_flight) < READ_ONCE(pool->depth);
+	     urb_index++)
+		sb_midex_usb_midi_input_submit(
+			midex, &midex->midi_in.urbs[urb_index], __func__);
 }
 
-static struct snd_rawmidi_ops sb_midex_raw_midi_output = {
-	.open = sb_midex_raw_midi_output_open,
-	.close = sb_midex_raw_midi_output_close,
-	.trigger = sb_midex_raw_midi_output_trigger,
-	.drain = sb_midex_usb_midi_output_drain,
-};
+/*
+ * Called every timing period while running: shrinks the input pool when no
+ * full input urbs were seen for a while.
+ */
+static void sb_midex_usb_midi_input_pool_tick(struct sb_midex *midex)
+{
+	struct sb_midex_in_pool *pool = &midex->midi_in_pool;
 
-static struct snd_rawmidi_ops sb_midex_raw_midi_input = {
-	.open = sb_midex_raw_midi_input_open,
-	.close = sb_midex_raw_midi_input_close,
-	.trigger = sb_midex_raw_midi_input_trigger,
-};
+	if (READ_ONCE(pool->busy)) {
+		WRITE_ONCE(pool->busy, false);
+		pool->idle_ticks = 0;
+		return;
+	}
 
-/******************************************************************************
- * USB functions
- ******************************************************************************/
+	if (++pool->idle_ticks < SB_MIDEX_NUM_IN_URBS_IDLE_TICKS ||
+	    pool->depth <= SB_MIDEX_NUM_IN_URBS_MIN)
+		return;
+
+	/*
+	 * the next urb to complete above the depth is not resubmitted;
+	 * unlinking one now could lose the input it holds
+	 */
+	pool->idle_ticks = 0;
+	WRITE_ONCE(pool->depth, pool->depth - 1);
+}
 
 static void sb_midex_usb_midi_input_start(struct sb_midex *midex)
 {
-	int urb_index;
-
 	if (midex->midi_in.num_ports == 0)
 		return;
 
 	if (!midex->midi_in.active) {
-		midex->midi_in.active = true;
-
-		for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP;
-		     urb_index++)
-			sb_midex_submit_urb(&midex->midi_in.urbs[urb_index],
-					    GFP_ATOMIC, __func__);
+		WRITE_ONCE(midex->midi_in.active, true);
+		sb_midex_usb_midi_input_fill(midex);
 	}
 }
 
@@ -468,21 +2929,129 @@ static void sb_midex_usb_midi_input_stop(struct sb_midex *midex)
 	if (midex->midi_in.num_ports == 0)
 		return;
 
-	for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP; ++urb_index)
+	/* clear first, see sb_midex_usb_midi_input_complete() */
+	WRITE_ONCE(midex->midi_in.active, false);
+	smp_mb();
+
+	for (urb_index = 0; urb_index < SB_MIDEX_NUM_IN_URBS_MAX; ++urb_index)
 		usb_unlink_urb(midex->midi_in.urbs[urb_index].urb);
+}
 
-	midex->midi_in.active = false;
+static void sb_midex_usb_midi_input_deliver(struct sb_midex *midex,
+					    struct sb_midex_port *port)
+{
+	struct snd_rawmidi_substream *substream = READ_ONCE(port->substream);
+
+	/* dropped if the substream was closed since the bytes were staged */
+	if (substream) {
+		snd_rawmidi_receive(substream, port->batch->data,
+				    port->batch->len);
+		WRITE_ONCE(midex->midi_in_deliveries,
+			   midex->midi_in_deliveries + 1);
+	}
+	port->batch->len = 0;
+}
+
+/*
+ * Passes all staged input bytes to ALSA, one call per port.
+ */
+static void sb_midex_usb_midi_input_flush(struct sb_midex *midex)
+{
+	int port_index;
+
+	for (port_index = 0; port_index < midex->midi_in.num_ports;
+	     ++port_index) {
+		if (midex->midi_in.ports[port_index].batch->len)
+			sb_midex_usb_midi_input_deliver(
+				midex, &midex->midi_in.ports[port_index]);
+	}
+
+#if IS_ENABLED(CONFIG_SND_SEQUENCER)
+	sb_midex_seq_input_flush(midex);
+#endif
+#ifdef SB_MIDEX_HAVE_UMP
+	sb_midex_ump_input_flush(midex);
+#endif
+}
+
+/*
+ * Reserves @len bytes in the port's staging buffer, and returns where to
+ * store them (or NULL if the port is not receiving).
+ */
+static uint8_t *sb_midex_usb_midi_input_reserve(struct sb_midex *midex,
+						struct sb_midex_port *port,
+						unsigned int len)
+{
+	struct snd_rawmidi_substream *substream = READ_ONCE(port->substream);
+	uint8_t *dest;
+
+	if (!READ_ONCE(port->triggered) || !substream)
+		return NULL;
+
+	if (port->batch->len + len > SB_MIDEX_IN_BATCH_SIZE)
+		sb_midex_usb_midi_input_deliver(midex, port);
+
+	dest = &port->batch->data[port->batch->len];
+	port->batch->len += len;
+
+	return dest;
+}
+
+/*
+ * Stages the bytes of one input packet for the port.
+ */
+static void sb_midex_usb_midi_input_append(struct sb_midex *midex,
+					   struct sb_midex_port *port,
+					   const uint8_t *data,
+					   unsigned int len)
+{
+	uint8_t *dest = sb_midex_usb_midi_input_reserve(midex, port, len);
+
+	if (dest)
+		memcpy(dest, data, len);
+}
+
+/*
+ * SysEx fast path: stages the data bytes of @num_packets consecutive
+ * [P4 XX XX XX] packets of one port as a single contiguous chunk.
+ */
+static void sb_midex_usb_midi_input_append_sysex(struct sb_midex *midex,
+						 struct sb_midex_port *port,
+						 const uint8_t *packets,
+						 unsigned int num_packets)
+{
+	uint8_t *dest = sb_midex_usb_midi_input_reserve(midex, port,
+							num_packets * 3);
+
+	if (!dest)
+		return;
+
+	while (num_packets--) {
+		dest[0] = packets[1];
+		dest[1] = packets[2];
+		dest[2] = packets[3];
+		dest += 3;
+		packets += 4;
+	}
 }
 
+/*
+ * Parses one input URB buffer, received at @now, into the per port staging
+ * buffers. The caller flushes them with sb_midex_usb_midi_input_flush().
+ */
 static void sb_midex_usb_midi_input_to_raw_midi(struct sb_midex *midex,
 						const unsigned char *buffer,
-						unsigned int buf_len)
+						unsigned int buf_len,
+						ktime_t now)
 {
-	unsigned long flags;
 	int buf_index;
 	unsigned char port;
 	unsigned char status;
 	unsigned char out_len;
+	unsigned int run_end;
+	unsigned int activity = 0;
+	uint8_t filter;
+	ktime_t tstamp;
 
 	/* We expect midi input in blocks of 4 bytes.
 	 * Warn if we get weird sizes
@@ -493,17 +3062,69 @@ static void sb_midex_usb_midi_input_to_raw_midi(struct sb_midex *midex,
 			 buf_len);
 	}
 
-	spin_lock_irqsave(&midex->midi_in.lock, flags);
+	buf_len = min_t(unsigned int, buf_len & ~0x03,
+			SB_MIDEX_URB_BUFFER_SIZE);
+	WRITE_ONCE(midex->midi_in_packets, midex->midi_in_packets + buf_len / 4);
+
+	if (atomic_xchg(&midex->clock_restart, 0)) {
+		sb_midex_clock_reset(&midex->clock);
+		for (port = 0; port < midex->midi_in.num_ports; ++port)
+			midex->midi_in.ports[port].tstamp = 0;
+	}
 
 	for (buf_index = 0; buf_index < buf_len; buf_index += 4) {
 		port = (buffer[buf_index] >> 4) & 0x07;
 
 		status = buffer[buf_index] & 0x0f;
+
+		/* a device time stamp is for the packet that follows it */
+		tstamp = midex->midi_in.ports[port].tstamp ?: now;
+		midex->midi_in.ports[port].tstamp = 0;
+
+		if (status == 0x04) {
+			activity |= 1 << port;
+			/* SysEx data: take all following packets of the port */
+			for (run_end = buf_index + 4;
+			     run_end < buf_len &&
+			     buffer[run_end] == buffer[buf_index];
+			     run_end += 4)
+				;
+#if IS_ENABLED(CONFIG_SND_SEQUENCER)
+			sb_midex_seq_input(midex, &buffer[buf_index],
+					   (run_end - buf_index) / 4, tstamp);
+#endif
+#ifdef SB_MIDEX_HAVE_UMP
+			sb_midex_ump_input(midex, &buffer[buf_index],
+					   (run_end - buf_index) / 4);
+#endif
+			sb_midex_usb_midi_input_append_sysex(
+				midex, &midex->midi_in.ports[port],
+				&buffer[buf_index], (run_end - buf_index) / 4);
+			buf_index = run_end - 4;
+			continue;
+		}
+
 		switch (status) {
-		case 0x03: /* MIDEX time info. We ignore it (for now) */
+		case 0x03: /* MIDEX time info: [P3 F4 XX XX] */
+			if (buffer[buf_index + 1] == 0xf4)
+				midex->midi_in.ports[port].tstamp =
+					sb_midex_clock_to_host(
+						&midex->clock,
+						(buffer[buf_index + 2] << 8) |
+							buffer[buf_index + 3],
+						now);
 			out_len = 0;
 			break;
 		case 0x0f:
+			/* filtered realtime message (F8..FF) */
+			filter = READ_ONCE(midex->midi_in.ports[port]
+						   .realtime_filter);
+			if (buffer[buf_index + 1] >= 0xf8 &&
+			    (filter & (1 << (buffer[buf_index + 1] - 0xf8)))) {
+				out_len = 0;
+				break;
+			}
+
 			switch (buffer[buf_index + 1]) {
 			case 0xf1:
 			case 0xf3:
@@ -522,46 +3143,209 @@ static void sb_midex_usb_midi_input_to_raw_midi(struct sb_midex *midex,
 			break;
 		}
 
-		if ((out_len > 0) && midex->midi_in.ports[port].triggered &&
-		    midex->midi_in.ports[port].substream &&
-		    midex->midi_in.ports[port].substream->opened) {
-			snd_rawmidi_receive(
-				midex->midi_in.ports[port].substream,
-				&buffer[buf_index + 1], out_len);
-		}
+		if (out_len == 0)
+			continue;
+
+		activity |= 1 << port;
+#if IS_ENABLED(CONFIG_SND_SEQUENCER)
+		sb_midex_seq_input(midex, &buffer[buf_index], 1, tstamp);
+#endif
+#ifdef SB_MIDEX_HAVE_UMP
+		sb_midex_ump_input(midex, &buffer[buf_index], 1);
+#endif
+		sb_midex_usb_midi_input_append(
+			midex, &midex->midi_in.ports[port],
+			&buffer[buf_index + 1], out_len);
 	}
-	spin_unlock_irqrestore(&midex->midi_in.lock, flags);
+
+	if (activity)
+		atomic_or(activity, &midex->led_activity);
 }
 
-static void sb_midex_usb_midi_input_complete(struct urb *urb)
+/*
+ * Deferred input processing: parses all queued buffers, so back-to-back
+ * URBs are coalesced as well, then delivers once per port.
+ */
+static void sb_midex_usb_midi_input_work(struct work_struct *work)
+{
+	struct sb_midex *midex =
+		container_of(work, struct sb_midex, midi_in_queue.work);
+	struct sb_midex_in_queue *queue = &midex->midi_in_queue;
+	struct sb_midex_in_record *record;
+	unsigned int tail = queue->tail;
+
+	while (tail != smp_load_acquire(&queue->head)) {
+		record = &queue->records[tail & (SB_MIDEX_IN_QUEUE_LEN - 1)];
+		sb_midex_usb_midi_input_to_raw_midi(midex, record->data,
+						    record->len,
+						    record->arrival);
+		tail++;
+		smp_store_release(&queue->tail, tail);
+	}
+
+	sb_midex_usb_midi_input_flush(midex);
+}
+
+static void sb_midex_usb_midi_input_defer(struct sb_midex *midex,
+					  const struct urb *urb, ktime_t now)
+{
+	struct sb_midex_in_queue *queue = &midex->midi_in_queue;
+	struct sb_midex_in_record *record;
+	unsigned int head = queue->head;
+
+	if (head - smp_load_acquire(&queue->tail) >= SB_MIDEX_IN_QUEUE_LEN) {
+		WRITE_ONCE(queue->overruns, queue->overruns + 1);
+	} else {
+		record = &queue->records[head & (SB_MIDEX_IN_QUEUE_LEN - 1)];
+		record->arrival = now;
+		record->len = min_t(unsigned int, urb->actual_length,
+				    SB_MIDEX_URB_BUFFER_SIZE);
+		memcpy(record->data, urb->transfer_buffer, record->len);
+		smp_store_release(&queue->head, head + 1);
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	queue_work(system_bh_wq, &queue->work);
+#else
+	queue_work(system_highpri_wq, &queue->work);
+#endif
+}
+
+/*
+ * Copies the MIDI packets of the input ports with thru outputs straight into
+ * the output queue, with the port nibble rewritten, and kicks the output.
+ * Runs in the input completion, ahead of any deferred processing and of the
+ * realtime filter: a thru connection passes everything, like a cable.
+ * The packets go through the output queue of the port, so they are paced,
+ * and wait for a SysEx written to the port's substream to end. SysEx merged
+ * from several inputs into one output is not kept apart.
+ */
+static void sb_midex_usb_midi_input_thru(struct sb_midex *midex,
+					 const uint8_t *buffer,
+					 unsigned int buf_len)
 {
+	struct sb_midex_packet packet;
 	unsigned long flags;
+	unsigned int buf_index;
+	unsigned int num_packets = 0;
+	uint8_t outputs;
+	uint8_t status;
+	int port_index;
+
+	if (!READ_ONCE(midex->midi_thru_inputs))
+		return;
+
+	buf_len = min_t(unsigned int, buf_len & ~0x03,
+			SB_MIDEX_URB_BUFFER_SIZE);
+
+	spin_lock_irqsave(&midex->midi_out.lock, flags);
+	for (buf_index = 0; buf_index < buf_len; buf_index += 4) {
+		outputs = READ_ONCE(
+			midex->midi_in.ports[(buffer[buf_index] >> 4) & 0x07]
+				.thru);
+		status = buffer[buf_index] & 0x0f;
 
+		/* not MIDEX time info, nor reserved packets */
+		if (!outputs || !sb_midex_cin_length[status] ||
+		    (status == 0x03 && buffer[buf_index + 1] == 0xf4))
+			continue;
+
+		memcpy(packet.data, &buffer[buf_index], sizeof(packet.data));
+		for (port_index = 0; port_index < midex->midi_out.num_ports;
+		     ++port_index) {
+			if (!(outputs & (1 << port_index)))
+				continue;
+
+			num_packets++;
+			if (status == 0x0f && packet.data[1] >= 0xf8) {
+				sb_midex_usb_midi_output_queue_rt(
+					midex, port_index, packet.data[1]);
+				continue;
+			}
+
+			packet.data[0] = (port_index << 4) | status;
+			if (!kfifo_put(&midex->midi_out_queues[port_index].fifo,
+				       packet))
+				midex->midi_out_queue_overruns++;
+		}
+	}
+	spin_unlock_irqrestore(&midex->midi_out.lock, flags);
+
+	if (num_packets) {
+		WRITE_ONCE(midex->midi_thru_packets,
+			   midex->midi_thru_packets + num_packets);
+		sb_midex_usb_midi_output_kick(midex);
+	}
+}
+
+static void sb_midex_usb_midi_input_complete(struct urb *urb)
+{
 	struct sb_midex_urb_ctx *ctx = urb->context;
 	struct sb_midex *midex = ctx->midex;
+	struct sb_midex_in_pool *pool;
+	ktime_t start = ktime_get();
+
+	if (!midex)
+		return;
 
-	if (!midex || urb->status == -ESHUTDOWN)
+	pool = &midex->midi_in_pool;
+	atomic_dec(&pool->in_flight);
+	if (urb->status == -ESHUTDOWN) {
+		/* device gone: only give the urb back */
+		sb_midex_urb_release(ctx);
 		return;
+	}
+
+	sb_midex_urb_completed(ctx);
+
+	/* back-to-back full urbs: input may be waiting for a free urb */
+	if (!urb->status && urb->actual_length >= SB_MIDEX_URB_BUFFER_SIZE) {
+		WRITE_ONCE(pool->busy, true);
+		if (++pool->full_streak >= 2 &&
+		    pool->depth < SB_MIDEX_NUM_IN_URBS_MAX) {
+			pool->full_streak = 0;
+			WRITE_ONCE(pool->depth, pool->depth + 1);
+			if (pool->depth > pool->high_water)
+				WRITE_ONCE(pool->high_water, pool->depth);
+		}
+	} else {
+		pool->full_streak = 0;
+	}
+
+	if (!urb->status)
+		sb_midex_usb_midi_input_thru(midex, urb->transfer_buffer,
+					     urb->actual_length);
 
 	/* Process data and submit it again */
 	if (urb->status) {
 		sb_midex_urb_show_error(urb, __func__);
+	} else if (input_deferred) {
+		sb_midex_usb_midi_input_defer(midex, urb, start);
 	} else {
-		/* do some processing */
 		sb_midex_usb_midi_input_to_raw_midi(midex, urb->transfer_buffer,
-						    urb->actual_length);
+						    urb->actual_length, start);
+		sb_midex_usb_midi_input_flush(midex);
 	}
 
-	spin_lock_irqsave(&midex->timer_timing_lock, flags);
+	/* done with the buffer */
+	sb_midex_urb_release(ctx);
 
-	if (midex->midi_in.active &&
-	    midex->timing_state == SB_MIDEX_TIMING_RUNNING) {
-		sb_midex_submit_urb(ctx, GFP_ATOMIC, __func__);
-	} else {
-		ctx->active = false;
+	if (READ_ONCE(midex->midi_in.active) &&
+	    READ_ONCE(midex->timing_state) == SB_MIDEX_TIMING_RUNNING &&
+	    atomic_read(&pool->in_flight) < READ_ONCE(pool->depth)) {
+		sb_midex_usb_midi_input_submit(midex, ctx, __func__);
+		/* and any urbs the pool just grew by */
+		sb_midex_usb_midi_input_fill(midex);
+		/*
+		 * input_stop() clears active before unlinking; if it did so
+		 * while we were resubmitting, unlink this urb ourselves.
+		 */
+		smp_mb();
+		if (!READ_ONCE(midex->midi_in.active))
+			usb_unlink_urb(urb);
 	}
 
-	spin_unlock_irqrestore(&midex->timer_timing_lock, flags);
+	sb_midex_perf_add(&midex->midi_in_perf, start);
 }
 
 /*
@@ -580,189 +3364,507 @@ static void sb_midex_usb_midi_output_packet(struct urb *urb, uint8_t p0,
 	urb->transfer_buffer_length += 4;
 }
 
-/**
- * Converts MIDI commands to USB MIDI packets.
- *
- * \note (Same the ALSA USB MIDI driver's snd_usbmidi_transmit_byte)
+/*
+ * Encodes MIDI bytes of a port into USB MIDI packets, up to @max_len bytes of
+ * urb buffer, with the sb_midex_encoder table. Data bytes that complete a
+ * SysEx or running status packet are packed in one step.
+ * Returns the number of bytes encoded.
+ */
+static int sb_midex_usb_midi_output_encode(struct sb_midex *midex,
+					   struct sb_midex_port *port,
+					   uint8_t cable, const uint8_t *buf,
+					   int count, struct urb *urb,
+					   unsigned int max_len)
+{
+	const struct sb_midex_encoder_step *step;
+	uint8_t p0 = cable << 4;
+	uint8_t cin;
+	uint8_t b;
+	int i = 0;
+
+	while (i < count && urb->transfer_buffer_length + 4 <= max_len) {
+		if (port->state == STATE_SYSEX_0 && i + 3 <= count &&
+		    !((buf[i] | buf[i + 1] | buf[i + 2]) & 0x80)) {
+			sb_midex_usb_midi_output_packet(urb, p0 | 0x04, buf[i],
+							buf[i + 1], buf[i + 2]);
+			i += 3;
+			continue;
+		}
+		if (port->state == STATE_2PARAM_1 && i + 2 <= count &&
+		    !((buf[i] | buf[i + 1]) & 0x80)) {
+			sb_midex_usb_midi_output_packet(
+				urb, p0 | (port->midi_data[0] >> 4),
+				port->midi_data[0], buf[i], buf[i + 1]);
+			i += 2;
+			continue;
+		}
+
+		b = buf[i++];
+		step = &sb_midex_encoder[port->state][sb_midex_byte_class[b]];
+		cin = p0 | (step->cin ?: port->midi_data[0] >> 4);
+
+		switch (step->action) {
+		case ENC_STORE0:
+			port->midi_data[0] = b;
+			break;
+		case ENC_STORE1:
+			port->midi_data[1] = b;
+			break;
+		case ENC_EMIT1:
+			sb_midex_usb_midi_output_packet(urb, cin, b, 0, 0);
+			break;
+		case ENC_EMIT2:
+			sb_midex_usb_midi_output_packet(urb, cin,
+							port->midi_data[0], b, 0);
+			break;
+		case ENC_EMIT3:
+			sb_midex_usb_midi_output_packet(urb, cin,
+							port->midi_data[0],
+							port->midi_data[1], b);
+			break;
+		case ENC_REALTIME:
+			/*
+			 * goes ahead of the data already in this urb; with the
+			 * queue full, it stays unacked, like the bytes after it
+			 */
+			if (!sb_midex_usb_midi_output_queue_rt(midex, cable, b))
+				return i - 1;
+			break;
+		default:
+			break;
+		}
+		port->state = step->state;
+	}
+
+	return i;
+}
+
+#ifdef SB_MIDEX_ENCODER_BENCH
+#include "midex_bench.c"
+#endif
+
+/*
+ * Encodes a run of pending bytes of the port, up to @max_len bytes of urb
+ * buffer. The bytes are peeked in one go (no more than can fill the urb),
+ * and only the ones that were encoded are acked.
+ * Returns the number of bytes consumed from the substream.
+ */
+static int sb_midex_usb_midi_output_port(struct sb_midex_port *port,
+					 struct urb *urb, unsigned int max_len)
+{
+	uint8_t buf[SB_MIDEX_URB_BUFFER_SIZE / 4 * 3];
+	int num_packets;
+	int count;
+	int i;
+
+	if (urb->transfer_buffer_length + 4 > max_len)
+		return 0;
+
+	/* every packet holds 3 bytes at most */
+	num_packets = (max_len - urb->transfer_buffer_length) / 4;
+	count = snd_rawmidi_transmit_peek(
+		port->substream, buf,
+		min_t(int, num_packets * 3, sizeof(buf)));
+
+	i = sb_midex_usb_midi_output_encode(port->substream->rmidi->private_data,
+					    port, port->substream->number & 0x7,
+					    buf, count, urb, max_len);
+
+	if (i > 0)
+		snd_rawmidi_transmit_ack(port->substream, i);
+
+	return i;
+}
+
+/*
+ * Queues a packet for output from an in-kernel source (e.g. the sequencer
+ * client). The caller kicks the output. Returns false if the queue is full.
+ * System real-time packets go to the real-time queue instead.
+ */
+static bool sb_midex_usb_midi_output_queue_packet(struct sb_midex *midex,
+						  uint8_t p0, uint8_t p1,
+						  uint8_t p2, uint8_t p3)
+{
+	struct sb_midex_packet packet = { { p0, p1, p2, p3 } };
+	unsigned long flags;
+	bool queued;
+
+	spin_lock_irqsave(&midex->midi_out.lock, flags);
+	queued = sb_midex_usb_midi_output_queue_locked(midex, &packet);
+	spin_unlock_irqrestore(&midex->midi_out.lock, flags);
+
+	return queued;
+}
+
+/*
+ * sb_midex_usb_midi_output_queue_packet(), for callers that hold the
+ * midi_out lock.
+ */
+static bool
+sb_midex_usb_midi_output_queue_locked(struct sb_midex *midex,
+				      const struct sb_midex_packet *packet)
+{
+	bool queued;
+
+	if ((packet->data[0] & 0x0f) == 0x0f && packet->data[1] >= 0xf8)
+		return sb_midex_usb_midi_output_queue_rt(
+			midex, packet->data[0] >> 4, packet->data[1]);
+
+	queued = kfifo_put(
+		&midex->midi_out_queues[(packet->data[0] >> 4) & 0x07].fifo,
+		*packet);
+	if (!queued)
+		midex->midi_out_queue_overruns++;
+	return queued;
+}
+
+/*
+ * Queues a system real-time byte of a port for the head of the next urb,
+ * ahead of all other output, including the data of other ports. If all urbs
+ * are in flight, it is sent on the reserved urb. Returns false if the queue
+ * is full.
+ * Called with the midi_out lock held.
+ */
+static bool sb_midex_usb_midi_output_queue_rt(struct sb_midex *midex,
+					      uint8_t port, uint8_t b)
+{
+	struct sb_midex_packet packet = { { ((port & 0x07) << 4) | 0x0f, b,
+					    0, 0 } };
+
+	if (kfifo_put(&midex->midi_out_rt_queue, packet))
+		return true;
+
+	midex->midi_out_rt_overruns++;
+	return false;
+}
+
+/*
+ * Takes the real-time bytes at the head of a port that does not get to send
+ * now (paced or out of quota). Bytes behind other data of the port stay in
+ * order, as the rawmidi buffer can only be consumed from its head.
+ */
+static void sb_midex_usb_midi_output_port_rt(struct sb_midex *midex,
+					     struct sb_midex_port *port)
+{
+	uint8_t buf[8];
+	int count;
+	int i = 0;
+
+	count = snd_rawmidi_transmit_peek(port->substream, buf, sizeof(buf));
+	while (i < count && buf[i] >= 0xf8 &&
+	       !kfifo_is_full(&midex->midi_out_rt_queue))
+		sb_midex_usb_midi_output_queue_rt(
+			midex, port->substream->number, buf[i++]);
+
+	if (i > 0)
+		snd_rawmidi_transmit_ack(port->substream, i);
+}
+
+/* Moves queued real-time packets into the urb */
+static void sb_midex_usb_midi_output_rt(struct sb_midex *midex,
+					struct urb *urb)
+{
+	struct sb_midex_packet packet;
+
+	while (urb->transfer_buffer_length + 4 <= midex->midi_out_max_len &&
+	       kfifo_get(&midex->midi_out_rt_queue, &packet))
+		sb_midex_usb_midi_output_packet(urb, packet.data[0],
+						packet.data[1], packet.data[2],
+						packet.data[3]);
+}
+
+/*
+ * Returns true if the port's DIN line is too far behind to take more output
+ * now, and moves @wake to when it catches up, if that is sooner (0: unset).
+ */
+static bool sb_midex_usb_midi_output_paced(struct sb_midex_port *port,
+					   ktime_t now, ktime_t *wake)
+{
+	ktime_t ready;
+
+	if (!output_pacing)
+		return false;
+
+	ready = ktime_sub_ns(port->wire_free, SB_MIDEX_OUT_PACE_AHEAD_NS);
+	if (!ktime_after(ready, now))
+		return false;
+
+	if (!*wake || ktime_before(ready, *wake))
+		*wake = ready;
+	return true;
+}
+
+/*
+ * Adds the DIN line time of the packets in the urb, from byte @from on, to
+ * their ports.
+ */
+static void sb_midex_usb_midi_output_pace_charge(struct sb_midex *midex,
+						 const struct urb *urb,
+						 unsigned int from, ktime_t now)
+{
+	const uint8_t *buf = urb->transfer_buffer;
+	struct sb_midex_port *port;
+	unsigned int i;
+
+	for (i = from; i + 4 <= urb->transfer_buffer_length; i += 4) {
+		port = &midex->midi_out.ports[(buf[i] >> 4) & 0x07];
+		if (ktime_before(port->wire_free, now))
+			port->wire_free = now;
+		port->wire_free = ktime_add_ns(
+			port->wire_free,
+			sb_midex_cin_length[buf[i] & 0x0f] * SB_MIDEX_DIN_BYTE_NS);
+	}
+}
+
+/*
+ * Whether the packets of in-kernel sources for the port have to wait for
+ * the end of the substream's SysEx. If so, @wake is set to when they stop
+ * waiting, should the substream not send anything until then.
+ * Called with the midi_out lock held.
  */
-static void sb_midex_usb_midi_output_transmit_byte(struct sb_midex_port *port,
-						   uint8_t b, struct urb *urb)
+static bool sb_midex_usb_midi_output_sysex_held(struct sb_midex_port *port,
+						ktime_t now, ktime_t *wake)
 {
-	uint8_t p0 = (port->substream->number & 0x7) << 4;
+	ktime_t until;
 
-	if (b >= 0xf8) {
-		sb_midex_usb_midi_output_packet(urb, p0 | 0x0f, b, 0, 0);
-	} else if (b >= 0xf0) {
-		switch (b) {
-		case 0xf0:
-			port->midi_data[0] = b;
-			port->state = STATE_SYSEX_1;
-			break;
-		case 0xf1:
-		case 0xf3:
-			port->midi_data[0] = b;
-			port->state = STATE_1PARAM;
-			break;
-		case 0xf2:
-			port->midi_data[0] = b;
-			port->state = STATE_2PARAM_1;
-			break;
-		case 0xf4:
-		case 0xf5:
-			port->state = STATE_UNKNOWN;
-			break;
-		case 0xf6:
-			sb_midex_usb_midi_output_packet(urb, p0 | 0x05, 0xf6, 0,
-							0);
-			port->state = STATE_UNKNOWN;
-			break;
-		case 0xf7:
-			switch (port->state) {
-			case STATE_SYSEX_0:
-				sb_midex_usb_midi_output_packet(urb, p0 | 0x05,
-								0xf7, 0, 0);
-				break;
-			case STATE_SYSEX_1:
-				sb_midex_usb_midi_output_packet(
-					urb, p0 | 0x06, port->midi_data[0],
-					0xf7, 0);
-				break;
-			case STATE_SYSEX_2:
-				sb_midex_usb_midi_output_packet(
-					urb, p0 | 0x07, port->midi_data[0],
-					port->midi_data[1], 0xf7);
-				break;
-			default:
-				break;
-			}
-			port->state = STATE_UNKNOWN;
-			break;
-		}
-	} else if (b >= 0x80) {
-		port->midi_data[0] = b;
-		if (b >= 0xc0 && b <= 0xdf)
-			port->state = STATE_1PARAM;
-		else
-			port->state = STATE_2PARAM_1;
-	} else { /* b < 0x80 */
-		switch (port->state) {
-		case STATE_1PARAM:
-			if (port->midi_data[0] < 0xf0) {
-				p0 |= port->midi_data[0] >> 4;
-			} else {
-				p0 |= 0x02;
-				port->state = STATE_UNKNOWN;
-			}
-			sb_midex_usb_midi_output_packet(
-				urb, p0, port->midi_data[0], b, 0);
-			break;
-		case STATE_2PARAM_1:
-			port->midi_data[1] = b;
-			port->state = STATE_2PARAM_2;
-			break;
-		case STATE_2PARAM_2:
-			if (port->midi_data[0] < 0xf0) {
-				p0 |= port->midi_data[0] >> 4;
-				port->state = STATE_2PARAM_1;
-			} else {
-				p0 |= 0x03;
-				port->state = STATE_UNKNOWN;
-			}
-			sb_midex_usb_midi_output_packet(urb, p0,
-							port->midi_data[0],
-							port->midi_data[1], b);
-			break;
-		case STATE_SYSEX_0:
-			port->midi_data[0] = b;
-			port->state = STATE_SYSEX_1;
-			break;
-		case STATE_SYSEX_1:
-			port->midi_data[1] = b;
-			port->state = STATE_SYSEX_2;
-			break;
-		case STATE_SYSEX_2:
-			sb_midex_usb_midi_output_packet(urb, p0 | 0x04,
-							port->midi_data[0],
-							port->midi_data[1], b);
-			port->state = STATE_SYSEX_0;
-			break;
-		default:
-			break;
-		}
-	}
+	if (!port->substream || port->state < STATE_SYSEX_0 ||
+	    port->state > STATE_SYSEX_2)
+		return false;
+
+	until = ktime_add_ns(port->sent, SB_MIDEX_OUT_SYSEX_HOLD_NS);
+	if (!ktime_before(now, until))
+		return false;
+
+	if (!*wake || ktime_before(until, *wake))
+		*wake = until;
+	return true;
+}
+
+static enum hrtimer_restart sb_midex_usb_midi_output_pace_callback(
+	struct hrtimer *hrt)
+{
+	struct sb_midex *midex =
+		container_of(hrt, struct sb_midex, midi_out_pace_timer);
+
+	sb_midex_usb_midi_output_kick(midex);
+	return HRTIMER_NORESTART;
 }
 
+/*
+ * Fills the urb with the queued real-time packets, the UMP stream, then the
+ * ports. Each port in turn sends its packets of in-kernel sources and
+ * encodes one run of its pending rawmidi bytes, starting one port further
+ * than for the previous urb, and gets 1/SB_MIDEX_OUT_PORT_SHARE of the urb
+ * at most. A port with a long SysEx dump thus delays the other ports by a
+ * share of an urb, not by whole urbs, and each port still takes its bytes
+ * with one peek/ack.
+ * With output_pacing, a port (and the UMP stream) is only read while its DIN
+ * line keeps up; the pacing timer kicks the output again when the first one
+ * does. Real-time packets are not held back.
+ */
 static int sb_midex_usb_midi_output_from_raw_midi(struct sb_midex *midex,
 						  struct urb *urb)
 {
+	const unsigned int max_len = midex->midi_out_max_len;
+	const unsigned int quota =
+		max(max_len / 4 / SB_MIDEX_OUT_PORT_SHARE, 1U);
+	unsigned int num_packets[8] = { 0 };
+	int num_ports = midex->midi_out.num_ports;
+	int start_port;
 	int port_index;
-	uint8_t b;
+	int i;
+	int consumed;
+	unsigned int len;
+	unsigned int limit;
+	bool pending;
+	bool rawmidi;
+	bool held;
+	ktime_t now = ktime_get();
+	ktime_t wake = 0;
 	struct sb_midex_port *midi_port;
+	struct sb_midex_packet packet;
+	struct sb_midex_out_queue *queue;
 
-	for (port_index = 0; port_index < midex->midi_out.num_ports;
-	     ++port_index) {
-		midi_port = &midex->midi_out.ports[port_index];
+	/* real-time packets go first */
+	sb_midex_usb_midi_output_rt(midex, urb);
+	sb_midex_usb_midi_output_pace_charge(midex, urb, 0, now);
 
-		if (midi_port->substream == NULL)
-			dev_info(&midex->usbdev->dev,
-				 SB_MIDEX_PREFIX "substream = NULL...\n");
-		if (urb == NULL)
-			dev_info(&midex->usbdev->dev,
-				 SB_MIDEX_PREFIX "urb = NULL...\n");
+#ifdef SB_MIDEX_HAVE_UMP
+	sb_midex_ump_output(midex, urb, now, &wake);
+#endif
 
-		if ((midi_port->triggered == 0) ||
-		    !(midi_port->substream->opened))
-			continue;
-		/* Have seen cases with up to 20 bytes sent in 1 packet.
-		 * Assuming at least half the buffer can be used:
-		 */
-		while (urb->transfer_buffer_length + 3 <
-		       (SB_MIDEX_URB_BUFFER_SIZE / 2)) {
-			if (snd_rawmidi_transmit(midi_port->substream, &b, 1) !=
-			    1) {
-				midi_port->triggered = 0;
+	if (num_ports == 0)
+		goto out;
+
+	start_port = (midex->midi_out_first_port + 1) % num_ports;
+
+	do {
+		pending = false;
+
+		for (i = 0; i < num_ports; ++i) {
+			if (urb->transfer_buffer_length + 4 > max_len)
 				break;
+
+			port_index = (start_port + i) % num_ports;
+			midi_port = &midex->midi_out.ports[port_index];
+			queue = &midex->midi_out_queues[port_index];
+
+			rawmidi = midi_port->triggered && midi_port->substream;
+			if (!rawmidi && kfifo_is_empty(&queue->fifo))
+				continue;
+
+			if (num_packets[port_index] >= quota ||
+			    sb_midex_usb_midi_output_paced(midi_port, now,
+							   &wake)) {
+				if (rawmidi)
+					sb_midex_usb_midi_output_port_rt(
+						midex, midi_port);
+				continue;
+			}
+
+			/*
+			 * the packets of in-kernel sources, then one run of
+			 * the substream, up to what is left of the share;
+			 * the packets wait while the substream is in a SysEx
+			 */
+			len = urb->transfer_buffer_length;
+			limit = min(max_len,
+				    len + (quota - num_packets[port_index]) * 4);
+			held = !kfifo_is_empty(&queue->fifo) &&
+			       sb_midex_usb_midi_output_sysex_held(midi_port,
+								   now, &wake);
+			while (!held &&
+			       urb->transfer_buffer_length + 4 <= limit &&
+			       kfifo_get(&queue->fifo, &packet))
+				sb_midex_usb_midi_output_packet(
+					urb, packet.data[0], packet.data[1],
+					packet.data[2], packet.data[3]);
+
+			consumed = 0;
+			if (rawmidi) {
+				consumed = sb_midex_usb_midi_output_port(
+					midi_port, urb, limit);
+				if (consumed > 0)
+					midi_port->sent = now;
+				/* empty, unless a real-time byte is held */
+				if (consumed == 0 &&
+				    urb->transfer_buffer_length + 4 <= limit &&
+				    !kfifo_is_full(&midex->midi_out_rt_queue))
+					midi_port->triggered = 0;
+			}
+
+			if (urb->transfer_buffer_length > len) {
+				num_packets[port_index] +=
+					(urb->transfer_buffer_length - len) / 4;
+				sb_midex_usb_midi_output_pace_charge(midex, urb,
+								     len, now);
 			}
-			sb_midex_usb_midi_output_transmit_byte(midi_port, b,
-							       urb);
+			if ((consumed > 0 || urb->transfer_buffer_length > len) &&
+			    num_packets[port_index] < quota)
+				pending = true;
 		}
-	}
+	} while (pending && urb->transfer_buffer_length + 4 <= max_len);
+
+	midex->midi_out_first_port = start_port;
+
+out:
+	if (wake && !test_bit(SB_MIDEX_URB_GONE, &midex->urb_flags))
+		hrtimer_start(&midex->midi_out_pace_timer, wake,
+			      HRTIMER_MODE_ABS);
 
 	return 0;
 }
 
+/*
+ * Submits an output urb, and counts it as in flight for every port it has
+ * data for, so drain can wait for exactly those.
+ * Called with the midi_out lock held.
+ */
+static void sb_midex_usb_midi_output_submit(struct sb_midex *midex,
+					    struct sb_midex_urb_ctx *ctx)
+{
+	const uint8_t *buf = ctx->urb->transfer_buffer;
+	unsigned int i;
+
+	ctx->ports = 0;
+	for (i = 0; i + 4 <= ctx->urb->transfer_buffer_length; i += 4)
+		ctx->ports |= 1 << ((buf[i] >> 4) & 0x07);
+	atomic_or(ctx->ports << 8, &midex->led_activity);
+
+	for (i = 0; i < 8; i++)
+		if (ctx->ports & (1 << i))
+			midex->midi_out.ports[i].urbs_in_flight++;
+
+	ctx->seq = midex->midi_out_seq++;
+	if (sb_midex_submit_urb(ctx, GFP_ATOMIC, __func__) < 0) {
+		for (i = 0; i < 8; i++)
+			if (ctx->ports & (1 << i))
+				midex->midi_out.ports[i].urbs_in_flight--;
+		ctx->ports = 0;
+	}
+}
+
 static void sb_midex_usb_midi_output(struct sb_midex *midex)
 {
+	struct sb_midex_urb_ctx *ctx;
+	struct sb_midex_urb_ctx *rt_ctx;
 	unsigned long flags;
-	int urb_index;
-	bool found_urb = false;
+	unsigned int num_bytes = 0;
+	unsigned int mode;
+	ktime_t kicked;
 
 	spin_lock_irqsave(&midex->midi_out.lock, flags);
 
-	/* find a free urb, and read data from raw midi,
+	kicked = READ_ONCE(midex->midi_out_kick_time);
+	mode = READ_ONCE(midex->midi_out_kick_mode);
+	if (kicked) {
+		WRITE_ONCE(midex->midi_out_kick_time, 0);
+		sb_midex_perf_add(&midex->midi_out_dispatch_perf[mode], kicked);
+	}
+
+	/* the replayed urbs go first, see sb_midex_usb_midi_output_replay() */
+	if (midex->midi_out_recovering) {
+		spin_unlock_irqrestore(&midex->midi_out.lock, flags);
+		return;
+	}
+
+	/* claim a free urb, and read data from raw midi,
 	 * until either no free urb or no data.
 	 */
-	for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP; ++urb_index) {
-		if (!midex->midi_out.urbs[urb_index].active) {
-			found_urb = true;
-			midex->midi_out.urbs[urb_index]
-				.urb->transfer_buffer_length = 0;
-			/* get output from raw_midi */
-			sb_midex_usb_midi_output_from_raw_midi(
-				midex, midex->midi_out.urbs[urb_index].urb);
-
-			if (midex->midi_out.urbs[urb_index]
-				    .urb->transfer_buffer_length > 0) {
-				sb_midex_submit_urb(
-					&midex->midi_out.urbs[urb_index],
-					GFP_ATOMIC, __func__);
-			} else {
-				/* no more data found */
-				break;
-			}
+	while ((ctx = sb_midex_urb_claim_free(midex, SB_MIDEX_EP_MIDI_OUT, 0,
+					      SB_MIDEX_NUM_URBS_PER_EP))) {
+		ctx->urb->transfer_buffer_length = 0;
+		/* get output from raw_midi */
+		sb_midex_usb_midi_output_from_raw_midi(midex, ctx->urb);
+
+		if (!ctx->urb->transfer_buffer_length) {
+			/* no more data found */
+			sb_midex_urb_release(ctx);
+			break;
 		}
+		num_bytes += ctx->urb->transfer_buffer_length;
+		sb_midex_usb_midi_output_submit(midex, ctx);
+	}
+
+	/*
+	 * Real-time bytes left over (all urbs in flight, or met while filling)
+	 * do not wait for a free urb.
+	 */
+	rt_ctx = &midex->midi_out.urbs[SB_MIDEX_OUT_RT_URB];
+	if (!kfifo_is_empty(&midex->midi_out_rt_queue) &&
+	    sb_midex_urb_claim(rt_ctx)) {
+		rt_ctx->urb->transfer_buffer_length = 0;
+		sb_midex_usb_midi_output_rt(midex, rt_ctx->urb);
+		sb_midex_usb_midi_output_pace_charge(midex, rt_ctx->urb, 0,
+						     ktime_get());
+		num_bytes += rt_ctx->urb->transfer_buffer_length;
+		midex->midi_out_rt_urbs++;
+		sb_midex_usb_midi_output_submit(midex, rt_ctx);
 	}
 
+	if (kicked)
+		midex->midi_out_dispatch_packets[mode] += num_bytes / 4;
+
 	spin_unlock_irqrestore(&midex->midi_out.lock, flags);
 
 	/* Assume the completion handler gets called, and thus any unsent
@@ -770,13 +3872,31 @@ static void sb_midex_usb_midi_output(struct sb_midex *midex)
 	 */
 }
 
+/*
+ * Marks a sent (or given up) output urb free again, and wakes the drain
+ * waiters of its ports. Called with the midi_out lock held.
+ */
+static void sb_midex_usb_midi_output_release(struct sb_midex *midex,
+					     struct sb_midex_urb_ctx *ctx)
+{
+	unsigned int i;
+
+	for (i = 0; i < 8; i++)
+		if ((ctx->ports & (1 << i)) &&
+		    midex->midi_out.ports[i].urbs_in_flight)
+			midex->midi_out.ports[i].urbs_in_flight--;
+	if (ctx->ports)
+		wake_up(&midex->drain_wait);
+	ctx->ports = 0;
+	sb_midex_urb_release(ctx);
+}
+
 static void sb_midex_usb_midi_output_complete(struct urb *urb)
 {
 	/* lock EP, find urb, set urb to inactive, unlock */
 	struct sb_midex_urb_ctx *ctx = urb->context;
 	struct sb_midex *midex = ctx->midex;
 	unsigned long flags;
-	unsigned int urb_index;
 
 	if (urb->status)
 		sb_midex_urb_show_error(urb, __func__);
@@ -786,66 +3906,202 @@ static void sb_midex_usb_midi_output_complete(struct urb *urb)
 		return;
 	}
 
+	if (sb_midex_urb_completed(ctx))
+		return;
+
 	spin_lock_irqsave(&midex->midi_out.lock, flags);
-	ctx->active = false;
-	if (unlikely(midex->drain_urbs)) {
-		urb_index = ctx - midex->midi_out.urbs;
-		midex->drain_urbs &= ~(1 << urb_index);
-		wake_up(&midex->drain_wait);
+	sb_midex_usb_midi_output_release(midex, ctx);
+	spin_unlock_irqrestore(&midex->midi_out.lock, flags);
+
+	sb_midex_usb_midi_output_kick(midex);
+}
+
+/*
+ * Sends the output urbs the recovery took over again, in the order they were
+ * first submitted, then lets new output go.
+ */
+static void sb_midex_usb_midi_output_replay(struct sb_midex *midex)
+{
+	struct sb_midex_urb_ctx *ctx;
+	struct sb_midex_urb_ctx *next;
+	unsigned long flags;
+	int urb_index;
+
+	spin_lock_irqsave(&midex->midi_out.lock, flags);
+	for (;;) {
+		next = NULL;
+		for (urb_index = 0; urb_index <= SB_MIDEX_OUT_RT_URB;
+		     ++urb_index) {
+			ctx = &midex->midi_out.urbs[urb_index];
+			if (ctx->replay &&
+			    (!next || (s32)(ctx->seq - next->seq) < 0))
+				next = ctx;
+		}
+		if (!next)
+			break;
+
+		WRITE_ONCE(next->replay, false);
+		if (sb_midex_submit_urb(next, GFP_ATOMIC, __func__) < 0)
+			sb_midex_usb_midi_output_release(midex, next);
 	}
+	midex->midi_out_recovering = false;
 	spin_unlock_irqrestore(&midex->midi_out.lock, flags);
 
-	sb_midex_usb_midi_output(midex); /* which is better? */
-	/* tasklet_schedule(&midex->midi_out_tasklet); */
+	sb_midex_usb_midi_output_kick(midex);
+}
+
+/* Returns the number of urbs in flight with data for the ports in the mask */
+static unsigned int sb_midex_usb_midi_output_in_flight(struct sb_midex *midex,
+						       unsigned int port_mask)
+{
+	unsigned int num_urbs = 0;
+	int port_index;
+
+	for (port_index = 0; port_index < 8; ++port_index)
+		if (port_mask & (1 << port_index))
+			num_urbs += READ_ONCE(
+				midex->midi_out.ports[port_index].urbs_in_flight);
+
+	return num_urbs;
+}
+
+/*
+ * The substream buffer is empty, but some data might still be in the
+ * currently active URBs, so we have to wait for those to complete.
+ * Only urbs with data for the ports in @port_mask are waited for, as long
+ * as the DIN line needs to send them (plus a margin).
+ */
+static void sb_midex_usb_midi_output_drain_urbs(struct sb_midex *midex,
+						unsigned int port_mask)
+{
+	unsigned int num_urbs;
+	long timeout;
+
+	num_urbs = sb_midex_usb_midi_output_in_flight(midex, port_mask);
+	if (!num_urbs)
+		return;
+
+	/* an urb holds 3 MIDI bytes per packet at most */
+	timeout = msecs_to_jiffies(SB_MIDEX_DRAIN_MARGIN_MS) +
+		  nsecs_to_jiffies((u64)num_urbs * midex->midi_out_max_len / 4 *
+				   3 * SB_MIDEX_DIN_BYTE_NS);
+
+	if (!wait_event_timeout(
+		    midex->drain_wait,
+		    !sb_midex_usb_midi_output_in_flight(midex, port_mask),
+		    timeout))
+		dev_warn(&midex->usbdev->dev,
+			 SB_MIDEX_PREFIX "MIDI output drain timed out\n");
 }
 
 static void
 sb_midex_usb_midi_output_drain(struct snd_rawmidi_substream *substream)
 {
-	struct sb_midex *midex = substream->rmidi->private_data;
-	unsigned int urb_index;
-	DEFINE_WAIT(wait);
-	long timeout = msecs_to_jiffies(50);
+	sb_midex_usb_midi_output_drain_urbs(substream->rmidi->private_data,
+					    1 << substream->number);
+}
 
-	/*
-	 * The substream buffer is empty, but some data might still be in the
-	 * currently active URBs, so we have to wait for those to complete.
-	 */
-	spin_lock_irq(&midex->midi_out.lock);
-	midex->drain_urbs = 0;
-	for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP; ++urb_index) {
-		if (midex->midi_out.urbs[urb_index].active)
-			midex->drain_urbs |= (1 << urb_index);
-	}
-	if (midex->drain_urbs) {
-		do {
-			prepare_to_wait(&midex->drain_wait, &wait,
-					TASK_UNINTERRUPTIBLE);
-			spin_unlock_irq(&midex->midi_out.lock);
+static void sb_midex_usb_midi_output_work(struct work_struct *work)
+{
+	sb_midex_usb_midi_output(
+		container_of(work, struct sb_midex, midi_out_work));
+}
+
+static void sb_midex_usb_midi_output_kthread_work(struct kthread_work *work)
+{
+	sb_midex_usb_midi_output(
+		container_of(work, struct sb_midex, midi_out_kthread_work));
+}
+
+/*
+ * Starts the realtime output thread. If that fails, output_dispatch 2 keeps
+ * using the work item.
+ */
+static void sb_midex_usb_midi_output_thread_start(struct sb_midex *midex)
+{
+	struct kthread_worker *worker;
 
-			timeout = schedule_timeout(timeout);
-			/* midi_output_complete will change the drain_urbs */
-			spin_lock_irq(&midex->midi_out.lock);
-		} while (midex->drain_urbs && timeout);
+	if (midex->midi_out_worker || midex->midi_out_thread_failed)
+		return;
 
-		finish_wait(&midex->drain_wait, &wait);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 14, 0)
+	worker = kthread_run_worker(0, "midex-out%d", midex->card_index);
+#else
+	worker = kthread_create_worker(0, "midex-out%d", midex->card_index);
+#endif
+	if (IS_ERR(worker)) {
+		dev_warn(&midex->usbdev->dev,
+			 SB_MIDEX_PREFIX
+			 "no output thread (%ld), using the work item\n",
+			 PTR_ERR(worker));
+		WRITE_ONCE(midex->midi_out_thread_failed, true);
+		return;
 	}
-	spin_unlock_irq(&midex->midi_out.lock);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	sched_set_fifo(worker->task);
+#endif
+	/* the kick only queues on it once it is set up */
+	smp_store_release(&midex->midi_out_worker, worker);
 }
 
-static void sb_midex_usb_midi_output_tasklet(unsigned long data)
+static void
+sb_midex_usb_midi_output_thread_start_work(struct work_struct *work)
+{
+	sb_midex_usb_midi_output_thread_start(
+		container_of(work, struct sb_midex, midi_out_thread_start));
+}
+
+/*
+ * Starts the MIDI output where output_dispatch says: directly in the caller,
+ * in a (BH) work item, or in the realtime output thread. Direct output is
+ * fine in any context, as the output path only uses irq-safe locks and
+ * GFP_ATOMIC. The thread is started in process context the first time it is
+ * asked for, the output uses the work item until it runs.
+ * The time from the first kick to the output run is recorded per mode, for
+ * /proc/asound/cardX/midex.
+ */
+static void sb_midex_usb_midi_output_kick(struct sb_midex *midex)
 {
-	struct sb_midex *midex = (struct sb_midex *)data;
+	unsigned int mode = READ_ONCE(output_dispatch);
+	struct kthread_worker *worker;
+
+	/* disconnect is stopping the output work */
+	if (test_bit(SB_MIDEX_URB_GONE, &midex->urb_flags))
+		return;
 
-	sb_midex_usb_midi_output(midex);
+	worker = smp_load_acquire(&midex->midi_out_worker);
+	if (mode == SB_MIDEX_DISPATCH_THREAD && !worker) {
+		if (!READ_ONCE(midex->midi_out_thread_failed))
+			schedule_work(&midex->midi_out_thread_start);
+		mode = SB_MIDEX_DISPATCH_WORK;
+	}
+
+	if (!READ_ONCE(midex->midi_out_kick_time)) {
+		WRITE_ONCE(midex->midi_out_kick_mode, mode);
+		WRITE_ONCE(midex->midi_out_kick_time, ktime_get());
+	}
+
+	switch (mode) {
+	case SB_MIDEX_DISPATCH_DIRECT:
+		sb_midex_usb_midi_output(midex);
+		break;
+	case SB_MIDEX_DISPATCH_THREAD:
+		kthread_queue_work(worker, &midex->midi_out_kthread_work);
+		break;
+	default:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+		queue_work(system_bh_wq, &midex->midi_out_work);
+#else
+		queue_work(system_highpri_wq, &midex->midi_out_work);
+#endif
+		break;
+	}
 }
 
 static void sb_midex_usb_timing_output_complete(struct urb *urb)
 {
-	unsigned long flags;
-
 	struct sb_midex_urb_ctx *ctx = urb->context;
-	struct sb_midex *midex = ctx->midex;
 
 	if (urb->status)
 		sb_midex_urb_show_error(urb, __func__);
@@ -856,11 +4112,8 @@ static void sb_midex_usb_timing_output_complete(struct urb *urb)
 		return;
 	}
 
-	spin_lock_irqsave(&midex->timer_timing_lock, flags);
-
-	ctx->active = false;
-
-	spin_unlock_irqrestore(&midex->timer_timing_lock, flags);
+	sb_midex_urb_completed(ctx);
+	sb_midex_urb_release(ctx);
 
 	/* Start reading MIDI input only after the timing (start) event has
 	 * been sent. Moved to timing_callback()...
@@ -884,9 +4137,13 @@ static void sb_midex_usb_led_output_complete(struct urb *urb)
 	if (!ctx || !midex)
 		return;
 
-	ctx->active = false;
+	sb_midex_urb_completed(ctx);
+	sb_midex_urb_release(ctx);
 
-	if (midex->led_state == SB_MIDEX_LED_RUNNING && !urb_err) {
+	/* only the keepalive [7f 9a] gets a reply */
+	if (midex->led_state == SB_MIDEX_LED_RUNNING && !urb_err &&
+	    ctx == &midex->led_commands_urb[0] &&
+	    sb_midex_urb_claim(&midex->led_replies_urb)) {
 		/* read reply from MIDEX */
 		sb_midex_submit_urb(&midex->led_replies_urb, GFP_ATOMIC,
 				    __func__);
@@ -903,146 +4160,515 @@ static void sb_midex_usb_led_input_complete(struct urb *urb)
 	if (!ctx)
 		return;
 
-	ctx->active = false;
+	sb_midex_urb_completed(ctx);
+	sb_midex_urb_release(ctx);
+}
+
+/******************************************************************************
+ * URB health monitor functions
+ ******************************************************************************/
+
+/*
+ * Returns how long the busiest output port's DIN line still has to send what
+ * it got.
+ */
+static u64 sb_midex_usb_midi_output_backlog_ns(struct sb_midex *midex,
+					       ktime_t now)
+{
+	unsigned long flags;
+	ktime_t last = now;
+	int i;
+
+	spin_lock_irqsave(&midex->midi_out.lock, flags);
+	for (i = 0; i < midex->midi_out.num_ports; i++)
+		if (ktime_after(midex->midi_out.ports[i].wire_free, last))
+			last = midex->midi_out.ports[i].wire_free;
+	spin_unlock_irqrestore(&midex->midi_out.lock, flags);
+
+	return ktime_to_ns(ktime_sub(last, now));
+}
+
+/*
+ * Looks at the endpoints with a stuck limit; with @check, flags those whose
+ * oldest urb made no progress for that long. Returns true if any urbs of
+ * them are in flight.
+ */
+static bool sb_midex_urb_monitor_scan(struct sb_midex *midex, bool check)
+{
+	struct sb_midex_urb_health *health;
+	struct sb_midex_urb_ctx *ctx;
+	ktime_t now = ktime_get();
+	ktime_t submitted;
+	ktime_t oldest;
+	u64 limit;
+	bool busy = false;
+	bool found;
+	int ep;
+	unsigned int i;
+
+	for (ep = 0; ep < SB_MIDEX_NUM_EPS; ep++) {
+		health = &midex->urb_health[ep];
+		if (!health->stuck_ns)
+			continue;
+
+		found = false;
+		for (i = 0; i < health->num_urbs; i++) {
+			ctx = &health->urbs[i];
+			submitted = READ_ONCE(ctx->submitted);
+			/* claimed urbs count once submitted */
+			if (sb_midex_urb_busy(ctx) && submitted &&
+			    (!found || ktime_before(submitted, oldest))) {
+				oldest = submitted;
+				found = true;
+			}
+		}
+		if (!found)
+			continue;
+		busy = true;
+
+		if (!check || sb_midex_urb_recovering(midex, ep) ||
+		    READ_ONCE(health->failed_recoveries) >=
+			    SB_MIDEX_URB_MAX_RECOVERIES)
+			continue;
+
+		/* urbs queued behind others wait for those */
+		if (ktime_before(oldest, READ_ONCE(health->last_complete)))
+			oldest = READ_ONCE(health->last_complete);
+		limit = health->stuck_ns;
+		if (ep == SB_MIDEX_EP_MIDI_OUT)
+			limit += sb_midex_usb_midi_output_backlog_ns(midex,
+								     now);
+		if (ktime_to_ns(ktime_sub(now, oldest)) > limit) {
+			set_bit(ep, &midex->urb_stuck);
+			schedule_work(&midex->urb_recover_work);
+		}
+	}
+
+	return busy;
+}
+
+/* Runs while urbs are in flight, see sb_midex_urb_monitor_arm() */
+static enum hrtimer_restart sb_midex_urb_monitor_callback(struct hrtimer *hrt)
+{
+	struct sb_midex *midex =
+		container_of(hrt, struct sb_midex, urb_monitor);
+	bool busy;
+
+	if (test_bit(SB_MIDEX_URB_GONE, &midex->urb_flags)) {
+		clear_bit(SB_MIDEX_URB_MONITOR_ARMED, &midex->urb_flags);
+		return HRTIMER_NORESTART;
+	}
+
+	busy = sb_midex_urb_monitor_scan(midex, true);
+	if (!busy) {
+		clear_bit(SB_MIDEX_URB_MONITOR_ARMED, &midex->urb_flags);
+		smp_mb__after_atomic();
+		/* an urb submitted while the bit was still set */
+		busy = sb_midex_urb_monitor_scan(midex, false) &&
+		       !test_and_set_bit(SB_MIDEX_URB_MONITOR_ARMED,
+					 &midex->urb_flags);
+	}
+	if (!busy)
+		return HRTIMER_NORESTART;
+
+	hrtimer_forward_now(hrt, ns_to_ktime(SB_MIDEX_URB_MONITOR_NS));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Recovers an endpoint: kills its urbs (the MIDI output ones are kept to be
+ * sent again), clears a halt, and restarts what the lost transfers were for.
+ * Sleeps.
+ */
+static void sb_midex_urb_recover(struct sb_midex *midex,
+				 enum sb_midex_urb_ep ep, bool stalled)
+{
+	struct sb_midex_urb_health *health = &midex->urb_health[ep];
+	unsigned long flags;
+	unsigned int i;
+	int err;
+
+	dev_warn_ratelimited(&midex->usbdev->dev,
+			     SB_MIDEX_PREFIX "%s %s, recovering\n",
+			     sb_midex_urb_ep_names[ep],
+			     stalled ? "stalled" : "stuck");
+	WRITE_ONCE(health->recoveries, health->recoveries + 1);
+	WRITE_ONCE(health->failed_recoveries, health->failed_recoveries + 1);
+
+	if (ep == SB_MIDEX_EP_MIDI_OUT) {
+		spin_lock_irqsave(&midex->midi_out.lock, flags);
+		midex->midi_out_recovering = true;
+		for (i = 0; i < health->num_urbs; i++)
+			if (sb_midex_urb_busy(&health->urbs[i]))
+				WRITE_ONCE(health->urbs[i].replay, true);
+		spin_unlock_irqrestore(&midex->midi_out.lock, flags);
+	} else if (ep == SB_MIDEX_EP_MIDI_IN) {
+		WRITE_ONCE(midex->midi_in.active, false);
+	}
+
+	for (i = 0; i < health->num_urbs; i++)
+		usb_kill_urb(health->urbs[i].urb);
+
+	if (stalled) {
+		err = usb_clear_halt(midex->usbdev, health->urbs[0].urb->pipe);
+		if (err < 0)
+			dev_err(&midex->usbdev->dev,
+				SB_MIDEX_PREFIX "usb_clear_halt %s: %d\n",
+				sb_midex_urb_ep_names[ep], err);
+	}
+
+	switch (ep) {
+	case SB_MIDEX_EP_MIDI_OUT:
+		sb_midex_usb_midi_output_replay(midex);
+		break;
+	case SB_MIDEX_EP_TIMING_OUT:
+	case SB_MIDEX_EP_MIDI_IN:
+		/*
+		 * The device may have missed the start, and sends no input
+		 * without it: send start and running now, which also starts
+		 * the input again. Both go on urbs of their own; the unlinking
+		 * of a tick would kill the start.
+		 */
+		clear_bit(ep, &midex->urb_recovering);
+		spin_lock_irqsave(&midex->timer_timing_lock, flags);
+		if (midex->timing_state == SB_MIDEX_TIMING_RUNNING ||
+		    midex->timing_state == SB_MIDEX_TIMING_START) {
+			WRITE_ONCE(midex->timing_state, SB_MIDEX_TIMING_START);
+			sb_midex_timing_send(midex);
+			sb_midex_timing_send(midex);
+		}
+		spin_unlock_irqrestore(&midex->timer_timing_lock, flags);
+		break;
+	case SB_MIDEX_EP_LED_OUT:
+		/* lost commands may have been LED changes: send all again */
+		memset(midex->led_shown, 0xff, sizeof(midex->led_shown));
+		break;
+	default:
+		/* the next keepalive reads the reply again */
+		break;
+	}
+}
+
+static void sb_midex_urb_recover_work(struct work_struct *work)
+{
+	struct sb_midex *midex =
+		container_of(work, struct sb_midex, urb_recover_work);
+	bool stalled;
+	bool stuck;
+	int ep;
+
+	for (ep = 0; ep < SB_MIDEX_NUM_EPS; ep++) {
+		if (test_bit(SB_MIDEX_URB_GONE, &midex->urb_flags))
+			return;
+
+		set_bit(ep, &midex->urb_recovering);
+		stalled = test_and_clear_bit(ep, &midex->urb_stalled);
+		stuck = test_and_clear_bit(ep, &midex->urb_stuck);
+		if (stalled || stuck)
+			sb_midex_urb_recover(midex, ep, stalled);
+		clear_bit(ep, &midex->urb_recovering);
+	}
+}
+
+/* Stops monitoring and recovery, before the urbs go away */
+static void sb_midex_urb_monitor_stop(struct sb_midex *midex)
+{
+	set_bit(SB_MIDEX_URB_GONE, &midex->urb_flags);
+	hrtimer_cancel(&midex->urb_monitor);
+	cancel_work_sync(&midex->urb_recover_work);
+}
+
+static void sb_midex_init_urb_health(struct sb_midex *midex,
+				     enum sb_midex_urb_ep ep,
+				     struct sb_midex_urb_ctx *urbs,
+				     unsigned int num_urbs, u64 stuck_ns)
+{
+	struct sb_midex_urb_health *health = &midex->urb_health[ep];
+	unsigned int i;
+
+	health->urbs = urbs;
+	health->num_urbs = num_urbs;
+	health->stuck_ns = stuck_ns;
+	health->last_complete = 0;
+	health->failed_recoveries = 0;
+	health->max_age_ns = 0;
+	health->stalls = 0;
+	health->recoveries = 0;
+	midex->urb_busy[ep] = 0;
+
+	for (i = 0; i < num_urbs; i++) {
+		urbs[i].ep = ep;
+		urbs[i].index = i;
+		urbs[i].replay = false;
+	}
 }
 
 /******************************************************************************
  * Device functions
  ******************************************************************************/
-static enum hrtimer_restart sb_midex_timer_timing_callback(struct hrtimer *hrt)
+/*
+ * Claims a free timing urb and sends the message of the current timing
+ * state on it.
+ * Called with the timer_timing lock held.
+ */
+static void sb_midex_timing_send(struct sb_midex *midex)
 {
-	int urb_index;
-	unsigned long flags;
+	struct sb_midex_urb_ctx *ctx;
 	unsigned char *buffer;
-	struct sb_midex *midex =
-		container_of(hrt, struct sb_midex, timer_timing);
-
-	spin_lock_irqsave(&midex->timer_timing_lock, flags);
-
-	/* unlink all still active urbs, it shouldn't take 25ms to send */
-	for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP; urb_index++) {
-		if (midex->timing_out_urb[urb_index].active) {
-			dev_info(&midex->usbdev->dev,
-				 SB_MIDEX_PREFIX
-				 "timing urb %d still active, unlinking",
-				 urb_index);
-			usb_unlink_urb(midex->timing_out_urb[urb_index].urb);
-		}
-	}
 
-	/* find a free urb */
-	for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP &&
-			    midex->timing_out_urb[urb_index].active;
-	     urb_index++)
-		;
-
-	/* if we found a free urb: use it. */
-	if (!midex->timing_out_urb[urb_index].active) {
+	/* if we can claim a free urb: use it. */
+	ctx = sb_midex_urb_claim_free(midex, SB_MIDEX_EP_TIMING_OUT, 0,
+				      SB_MIDEX_NUM_URBS_PER_EP);
+	if (ctx) {
 		/* always the same */
-		buffer = midex->timing_out_urb[urb_index].urb->transfer_buffer;
+		buffer = ctx->urb->transfer_buffer;
 		buffer[0] = 0x0f;
 		buffer[2] = 0;
 		buffer[3] = 0;
 
-		midex->timing_out_urb[urb_index].urb->transfer_buffer_length =
-			4;
+		ctx->urb->transfer_buffer_length = 4;
 
 		switch (midex->timing_state) {
 		case SB_MIDEX_TIMING_START:
+			/*
+			 * the device counter restarts, as does our mapping;
+			 * the input completion owns the clock and resets it
+			 */
+			atomic_set(&midex->clock_restart, 1);
+
 			buffer[1] = 0xfd; /* start*/
-			sb_midex_submit_urb(&midex->timing_out_urb[urb_index],
-					    GFP_ATOMIC, __func__);
+			sb_midex_submit_urb(ctx, GFP_ATOMIC, __func__);
 
-			midex->timing_state = SB_MIDEX_TIMING_RUNNING;
+			WRITE_ONCE(midex->timing_state,
+				   SB_MIDEX_TIMING_RUNNING);
 			break;
 		case SB_MIDEX_TIMING_RUNNING:
 			buffer[1] = 0xf9; /* running */
-			sb_midex_submit_urb(&midex->timing_out_urb[urb_index],
-					    GFP_ATOMIC, __func__);
+			sb_midex_submit_urb(ctx, GFP_ATOMIC, __func__);
 
 			if (!midex->midi_in.active &&
-			    (midex->timing_state != SB_MIDEX_TIMING_IDLE))
+			    (midex->timing_state != SB_MIDEX_TIMING_IDLE) &&
+			    !sb_midex_urb_recovering(midex,
+						     SB_MIDEX_EP_MIDI_IN))
 				sb_midex_usb_midi_input_start(midex);
+			else
+				sb_midex_usb_midi_input_pool_tick(midex);
 			break;
 		case SB_MIDEX_TIMING_STOP:
 			buffer[1] = 0xf5; /* stop */
-			sb_midex_submit_urb(&midex->timing_out_urb[urb_index],
-					    GFP_ATOMIC, __func__);
+			sb_midex_submit_urb(ctx, GFP_ATOMIC, __func__);
 
 			/* cancel outstanding MIDI-in urbs*/
 			sb_midex_usb_midi_input_stop(midex);
 
-			midex->timing_state = SB_MIDEX_TIMING_IDLE;
+			WRITE_ONCE(midex->timing_state, SB_MIDEX_TIMING_IDLE);
 			break;
 		default:
 		case SB_MIDEX_TIMING_IDLE:
-			/* do nothing */
+			/* nothing to send */
+			sb_midex_urb_release(ctx);
 			break;
 		}
 	}
+}
+
+/* Sends the timing message of the current timing state */
+static void sb_midex_timing_tick(struct sb_midex *midex)
+{
+	int urb_index;
+	unsigned long flags;
+
+	spin_lock_irqsave(&midex->timer_timing_lock, flags);
+
+	/* unlink all still active urbs, it shouldn't take 25ms to send */
+	for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP; urb_index++) {
+		if (sb_midex_urb_busy(&midex->timing_out_urb[urb_index])) {
+			dev_info(&midex->usbdev->dev,
+				 SB_MIDEX_PREFIX
+				 "timing urb %d still active, unlinking",
+				 urb_index);
+			usb_unlink_urb(midex->timing_out_urb[urb_index].urb);
+		}
+	}
 
-	/* We want this timer to be periodic, so forward it */
-	hrtimer_forward_now(&(midex->timer_timing), midex->timer_timing_deltat);
+	sb_midex_timing_send(midex);
 
 	spin_unlock_irqrestore(&midex->timer_timing_lock, flags);
+}
 
-	return HRTIMER_RESTART;
+/*
+ * The one periodic timer of the device: sends the timing messages, and runs
+ * the LED work every few periods. It stops once the device is idle (no users,
+ * the LED start up graphics done and all LEDs off), and
+ * sb_midex_device_use() wakes it.
+ */
+static enum hrtimer_restart sb_midex_timer_timing_callback(struct hrtimer *hrt)
+{
+	struct sb_midex *midex =
+		container_of(hrt, struct sb_midex, timer_timing);
+	unsigned long flags;
+	bool idle;
+
+	sb_midex_timing_tick(midex);
+	WRITE_ONCE(midex->timer_timing_ticks, midex->timer_timing_ticks + 1);
+
+	if (--midex->led_ticks <= 0) {
+		sb_midex_led_tick(midex);
+		midex->led_ticks = TIMER_TICKS_LED;
+	}
+
+	spin_lock_irqsave(&midex->timer_timing_lock, flags);
+	idle = midex->timing_state == SB_MIDEX_TIMING_IDLE &&
+	       midex->led_state == SB_MIDEX_LED_RUNNING &&
+	       !memchr_inv(midex->led_shown, 0, sizeof(midex->led_shown));
+	if (idle)
+		WRITE_ONCE(midex->timer_timing_active, false);
+	else
+		hrtimer_forward_now(hrt, midex->timer_timing_deltat);
+	spin_unlock_irqrestore(&midex->timer_timing_lock, flags);
+
+	return idle ? HRTIMER_NORESTART : HRTIMER_RESTART;
 }
 
-static int sb_midex_usb_led_fill_and_send_command(struct sb_midex_urb_ctx *ctx,
-						  unsigned char led_nr,
-						  bool led_state,
-						  bool led_is_left)
+/* Starts the timing timer if it stopped, with the LED work on its first tick */
+static void sb_midex_timer_timing_wake(struct sb_midex *midex)
 {
-	unsigned char *buf = ctx->urb->transfer_buffer;
+	unsigned long flags;
+
+	spin_lock_irqsave(&midex->timer_timing_lock, flags);
+	if (!midex->timer_timing_active && !midex->timer_timing_gone) {
+		WRITE_ONCE(midex->timer_timing_active, true);
+		midex->led_ticks = 1;
+		hrtimer_start(&midex->timer_timing, midex->timer_timing_deltat,
+			      HRTIMER_MODE_REL);
+	}
+	spin_unlock_irqrestore(&midex->timer_timing_lock, flags);
+}
 
+/* Writes [40 LL XX SS]: the LED of port @led_nr lit on @sides, or off */
+static void sb_midex_usb_led_command(unsigned char *buf, unsigned char led_nr,
+				     uint8_t sides)
+{
 	buf[0] = 0x40;
 	buf[1] = (0x44 | (led_nr << 3));
-	if (led_state) {
+	if (sides) {
 		buf[2] = 0xff;
-		buf[3] = led_is_left ? 0x02 : 0x01;
+		buf[3] = sides;
 	} else {
 		buf[2] = 0xfc;
 		buf[3] = 0x0;
 	}
+}
+
+static int sb_midex_usb_led_fill_and_send_command(struct sb_midex_urb_ctx *ctx,
+						  unsigned char led_nr,
+						  bool led_state,
+						  bool led_is_left)
+{
+	if (!sb_midex_urb_claim(ctx))
+		return -EBUSY;
 
+	sb_midex_usb_led_command(ctx->urb->transfer_buffer, led_nr,
+				 !led_state ? 0 : led_is_left ? 0x02 : 0x01);
 	ctx->urb->transfer_buffer_length = 4;
 
 	return sb_midex_submit_urb(ctx, GFP_ATOMIC, __func__);
 }
 
-static void sb_midex_timer_led_callback(struct timer_list *t)
+/*
+ * Submits a batch of LED commands. If that fails, the LEDs in it are marked
+ * unknown, so the next run sends them again.
+ */
+static void sb_midex_usb_led_send_batch(struct sb_midex *midex,
+					struct sb_midex_urb_ctx *ctx)
+{
+	const unsigned char *buf = ctx->urb->transfer_buffer;
+	unsigned int i;
+
+	if (sb_midex_submit_urb(ctx, GFP_ATOMIC, __func__) >= 0) {
+		midex->led_transfers++;
+		return;
+	}
+
+	for (i = 0; i + 4 <= ctx->urb->transfer_buffer_length; i += 4)
+		midex->led_shown[((buf[i + 1] - 0x44) >> 3) & 0x07] = 0xff;
+}
+
+/*
+ * Shows the MIDI traffic since the last LED work on the port LEDs, input on
+ * the left and output on the right side. An LED stays lit for one LED
+ * period at least, which limits the update rate. Only LEDs that change are
+ * sent, one per EP6 transfer (with led_batch: packed into as few transfers
+ * as wMaxPacketSize allows), on the command urbs the keepalive does not
+ * use; what can claim no free urb is sent by the next run.
+ * Both sides at once (SS = 3) are only sent with led_batch; else a port with
+ * input and output shows the input.
+ */
+static void sb_midex_led_activity(struct sb_midex *midex)
+{
+	unsigned int activity = atomic_xchg(&midex->led_activity, 0);
+	struct sb_midex_urb_ctx *ctx = NULL;
+	struct urb *urb;
+	int led_nr;
+	uint8_t sides;
+
+	for (led_nr = 0; led_nr < 8; led_nr++) {
+		sides = ((activity & (1 << led_nr)) ? SB_MIDEX_LED_IN : 0) |
+			((activity & (1 << (8 + led_nr))) ? SB_MIDEX_LED_OUT :
+							    0);
+		if (!led_batch && sides == (SB_MIDEX_LED_IN | SB_MIDEX_LED_OUT))
+			sides = SB_MIDEX_LED_IN;
+		if (sides == midex->led_shown[led_nr])
+			continue;
+
+		if (ctx && ctx->urb->transfer_buffer_length + 4 >
+				   midex->led_max_len) {
+			sb_midex_usb_led_send_batch(midex, ctx);
+			ctx = NULL;
+		}
+		if (!ctx) {
+			ctx = sb_midex_urb_claim_free(midex,
+						      SB_MIDEX_EP_LED_OUT, 1,
+						      SB_MIDEX_NUM_URBS_PER_EP);
+			if (!ctx)
+				break;
+			ctx->urb->transfer_buffer_length = 0;
+		}
+
+		urb = ctx->urb;
+		sb_midex_usb_led_command((unsigned char *)urb->transfer_buffer +
+						 urb->transfer_buffer_length,
+					 led_nr, sides);
+		urb->transfer_buffer_length += 4;
+		midex->led_shown[led_nr] = sides;
+	}
+
+	if (ctx)
+		sb_midex_usb_led_send_batch(midex, ctx);
+}
+
+/*
+ * LED work: the start up graphics, then the activity LEDs, and the
+ * keepalive ([7f 9a] with its [2f] reply) while the device is in use.
+ * Runs from the timing timer.
+ */
+static void sb_midex_led_tick(struct sb_midex *midex)
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
-	struct sb_midex *midex = timer_container_of(midex, t, timer_led);
-#else
-	struct sb_midex *midex = from_timer(midex, t, timer_led);
-#endif
 	unsigned char *buffer;
 	int ret;
 	unsigned char led_nr;
 
-	/* We want this timer to be periodic... */
-	if (midex->timing_state != SB_MIDEX_TIMING_IDLE)
-		mod_timer(&(midex->timer_led),
-			  jiffies +
-				  msecs_to_jiffies(TIMER_PERIOD_LED_ACTIVE_MS));
-	else
-		mod_timer(&(midex->timer_led),
-			  jiffies + msecs_to_jiffies(
-					    TIMER_PERIOD_LED_INACTIVE_MS));
-
 	/* check if the previously sent urb was still active...
 	 * it shouldn't be afte 50+ms, but it can happen.
 	 */
-	if (midex->led_replies_urb.active ||
-	    midex->led_commands_urb[0].active) {
-		if (midex->led_commands_urb[0].active) {
+	if (sb_midex_urb_busy(&midex->led_replies_urb) ||
+	    sb_midex_urb_busy(&midex->led_commands_urb[0])) {
+		if (sb_midex_urb_busy(&midex->led_commands_urb[0])) {
 			dev_info(&midex->usbdev->dev, SB_MIDEX_PREFIX
 				 "led reply urb still active, unlinking");
 			usb_unlink_urb(midex->led_commands_urb[0].urb);
 		}
-		if (midex->led_replies_urb.active) {
+		if (sb_midex_urb_busy(&midex->led_replies_urb)) {
 			dev_info(&midex->usbdev->dev, SB_MIDEX_PREFIX
 				 "led reply urb still active, unlinking");
 			usb_unlink_urb(midex->led_replies_urb.urb);
@@ -1053,18 +4679,27 @@ static void sb_midex_timer_led_callback(struct timer_list *t)
 	switch (midex->led_state) {
 	default:
 	case SB_MIDEX_LED_RUNNING:
+		sb_midex_led_activity(midex);
+
+		if (midex->timing_state == SB_MIDEX_TIMING_IDLE ||
+		    ++midex->led_runs < SB_MIDEX_LED_KEEPALIVE_RUNS)
+			break;
+		midex->led_runs = 0;
+
 		buffer = midex->led_commands_urb[0].urb->transfer_buffer;
 		buffer[0] = 0x7f;
 		buffer[1] = 0x9a;
 		midex->led_commands_urb[0].urb->transfer_buffer_length = 2;
 
-		ret = sb_midex_submit_urb(&midex->led_commands_urb[0],
-					  GFP_ATOMIC, __func__);
+		if (sb_midex_urb_claim(&midex->led_commands_urb[0]))
+			ret = sb_midex_submit_urb(&midex->led_commands_urb[0],
+						  GFP_ATOMIC, __func__);
 		break;
 	case SB_MIDEX_LED_INIT: /* start of device */
 		/* read reply from MIDEX */
-		sb_midex_submit_urb(&midex->led_replies_urb, GFP_ATOMIC,
-				    __func__);
+		if (sb_midex_urb_claim(&midex->led_replies_urb))
+			sb_midex_submit_urb(&midex->led_replies_urb, GFP_ATOMIC,
+					    __func__);
 		midex->led_state = SB_MIDEX_LED_GFX_RUN_OUT;
 		break;
 
@@ -1143,24 +4778,11 @@ static void sb_midex_timer_led_callback(struct timer_list *t)
 
 static void sb_midex_timer_timing_start(struct sb_midex *midex)
 {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
-	hrtimer_setup(&(midex->timer_timing), sb_midex_timer_timing_callback,
-		      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-#else
-	hrtimer_init(&(midex->timer_timing), CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	midex->timer_timing.function = sb_midex_timer_timing_callback;
-#endif
-
 	midex->timer_timing_deltat = ktime_set(0, TIMER_PERIOD_TIMING_NS);
-	hrtimer_start(&(midex->timer_timing), midex->timer_timing_deltat,
-		      HRTIMER_MODE_REL);
-}
-
-static void sb_midex_timer_led_start(struct sb_midex *midex)
-{
-	timer_setup(&(midex->timer_led), sb_midex_timer_led_callback, 0);
-	mod_timer(&(midex->timer_led),
-		  jiffies + msecs_to_jiffies(TIMER_PERIOD_LED_INACTIVE_MS));
+	midex->timer_timing_active = false;
+	midex->timer_timing_gone = false;
+	/* runs the LED start up graphics, then stops until the first use */
+	sb_midex_timer_timing_wake(midex);
 }
 
 /**
@@ -1177,6 +4799,7 @@ static int sb_midex_init_device(struct sb_midex *midex)
 	usb_anchor_urb(midex->led_replies_urb.urb, &midex->anchor);
 
 	/* Start reading EP6in(led_reply) */
+	sb_midex_urb_claim(&midex->led_replies_urb);
 	err = sb_midex_submit_urb(&midex->led_replies_urb, GFP_KERNEL,
 				  __func__);
 	if (err < 0)
@@ -1192,15 +4815,14 @@ static int sb_midex_init_device(struct sb_midex *midex)
 	buffer[1] = 0x01;
 	midex->led_commands_urb[0].urb->transfer_buffer_length = 2;
 
+	sb_midex_urb_claim(&midex->led_commands_urb[0]);
 	err = sb_midex_submit_urb(&midex->led_commands_urb[0], GFP_KERNEL,
 				  __func__);
 	if (err < 0)
 		goto init_device_error;
 
-	/* after this, the timers handle the rest */
-	/* start timer for EP6out(LED) */
-	sb_midex_timer_led_start(midex);
-	/* start timer for EP2out(timing) */
+	/* after this, the timer handles the rest */
+	/* start timer for EP2out(timing) and EP6out(LED) */
 	sb_midex_timer_timing_start(midex);
 
 init_device_error:
@@ -1212,6 +4834,8 @@ init_device_error:
  */
 static int sb_midex_init_usb(struct sb_midex *midex)
 {
+	struct usb_host_endpoint *ep;
+	unsigned int max_len;
 	int urb_index;
 	int err = usb_set_interface(midex->usbdev, 0, 0);
 
@@ -1221,44 +4845,59 @@ static int sb_midex_init_usb(struct sb_midex *midex)
 		return err;
 	}
 
-	/* alloc urbs */
-	midex->led_replies_urb.urb = sb_midex_urb_and_buffer_alloc(
-		midex, usb_rcvintpipe(midex->usbdev, 0x86), 8,
-		sb_midex_usb_led_input_complete, &midex->led_replies_urb);
-
-	if (!midex->led_replies_urb.urb)
+	/*
+	 * The firmware should take as many packets per transfer as EP4's
+	 * wMaxPacketSize allows; the module parameter limits that (to the old
+	 * 32 bytes by default).
+	 */
+	ep = usb_pipe_endpoint(midex->usbdev,
+			       usb_sndintpipe(midex->usbdev, 0x04));
+	max_len = ep ? usb_endpoint_maxp(&ep->desc) :
+		       SB_MIDEX_URB_BUFFER_SIZE / 2;
+	if (output_urb_payload > 0 && output_urb_payload < max_len)
+		max_len = output_urb_payload;
+	midex->midi_out_max_len =
+		clamp_t(unsigned int, max_len & ~0x03, 4,
+			SB_MIDEX_URB_BUFFER_SIZE);
+	dev_dbg(&midex->usbdev->dev,
+		SB_MIDEX_PREFIX "MIDI output: %u bytes per urb\n",
+		midex->midi_out_max_len);
+
+	ep = usb_pipe_endpoint(midex->usbdev,
+			       usb_sndintpipe(midex->usbdev, 0x06));
+	max_len = ep ? usb_endpoint_maxp(&ep->desc) : 8;
+	if (!led_batch)
+		max_len = 4; /* one command per transfer, as confirmed */
+	midex->led_max_len = clamp_t(unsigned int, max_len & ~0x03, 4,
+				     SB_MIDEX_LED_BUFFER_SIZE);
+
+	/* alloc urbs, with the buffers of an endpoint next to each other */
+	if (sb_midex_dma_arena_alloc(midex, SB_MIDEX_DMA_MIDI_IN,
+				     SB_MIDEX_DMA_MIDI_IN_SIZE) < 0 ||
+	    sb_midex_dma_arena_alloc(midex, SB_MIDEX_DMA_MIDI_OUT,
+				     SB_MIDEX_DMA_MIDI_OUT_SIZE) < 0 ||
+	    sb_midex_dma_arena_alloc(midex, SB_MIDEX_DMA_LED,
+				     SB_MIDEX_DMA_LED_SIZE) < 0)
 		goto init_usb_error;
 
-	for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP; ++urb_index) {
-		midex->led_commands_urb[urb_index].urb =
-			sb_midex_urb_and_buffer_alloc(
-				midex, usb_sndintpipe(midex->usbdev, 0x06), 8,
-				sb_midex_usb_led_output_complete,
-				&midex->led_commands_urb[urb_index]);
-		if (!midex->led_commands_urb[urb_index].urb)
-			goto init_usb_error;
-
-		midex->timing_out_urb[urb_index].urb =
-			sb_midex_urb_and_buffer_alloc(
-				midex, usb_sndintpipe(midex->usbdev, 0x02),
-				SB_MIDEX_URB_BUFFER_SIZE,
-				sb_midex_usb_timing_output_complete,
-				&midex->timing_out_urb[urb_index]);
-		if (!midex->timing_out_urb[urb_index].urb)
-			goto init_usb_error;
-
+	for (urb_index = 0; urb_index < SB_MIDEX_NUM_IN_URBS_MAX; ++urb_index) {
 		midex->midi_in.urbs[urb_index].urb =
 			sb_midex_urb_and_buffer_alloc(
-				midex, usb_rcvintpipe(midex->usbdev, 0x82),
+				midex, &midex->dma_arenas[SB_MIDEX_DMA_MIDI_IN],
+				usb_rcvintpipe(midex->usbdev, 0x82),
 				SB_MIDEX_URB_BUFFER_SIZE,
 				sb_midex_usb_midi_input_complete,
 				&midex->midi_in.urbs[urb_index]);
 		if (!midex->midi_in.urbs[urb_index].urb)
 			goto init_usb_error;
+	}
 
+	for (urb_index = 0; urb_index <= SB_MIDEX_OUT_RT_URB; ++urb_index) {
 		midex->midi_out.urbs[urb_index].urb =
 			sb_midex_urb_and_buffer_alloc(
-				midex, usb_sndintpipe(midex->usbdev, 0x04),
+				midex,
+				&midex->dma_arenas[SB_MIDEX_DMA_MIDI_OUT],
+				usb_sndintpipe(midex->usbdev, 0x04),
 				SB_MIDEX_URB_BUFFER_SIZE,
 				sb_midex_usb_midi_output_complete,
 				&midex->midi_out.urbs[urb_index]);
@@ -1266,15 +4905,164 @@ static int sb_midex_init_usb(struct sb_midex *midex)
 			goto init_usb_error;
 	}
 
+	for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP; ++urb_index) {
+		midex->timing_out_urb[urb_index].urb =
+			sb_midex_urb_and_buffer_alloc(
+				midex,
+				&midex->dma_arenas[SB_MIDEX_DMA_MIDI_OUT],
+				usb_sndintpipe(midex->usbdev, 0x02),
+				SB_MIDEX_URB_BUFFER_SIZE,
+				sb_midex_usb_timing_output_complete,
+				&midex->timing_out_urb[urb_index]);
+		if (!midex->timing_out_urb[urb_index].urb)
+			goto init_usb_error;
+	}
+
+	for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP; ++urb_index) {
+		midex->led_commands_urb[urb_index].urb =
+			sb_midex_urb_and_buffer_alloc(
+				midex, &midex->dma_arenas[SB_MIDEX_DMA_LED],
+				usb_sndintpipe(midex->usbdev, 0x06),
+				SB_MIDEX_LED_BUFFER_SIZE,
+				sb_midex_usb_led_output_complete,
+				&midex->led_commands_urb[urb_index]);
+		if (!midex->led_commands_urb[urb_index].urb)
+			goto init_usb_error;
+	}
+
+	midex->led_replies_urb.urb = sb_midex_urb_and_buffer_alloc(
+		midex, &midex->dma_arenas[SB_MIDEX_DMA_LED],
+		usb_rcvintpipe(midex->usbdev, 0x86),
+		SB_MIDEX_LED_REPLY_BUFFER_SIZE, sb_midex_usb_led_input_complete,
+		&midex->led_replies_urb);
+	if (!midex->led_replies_urb.urb)
+		goto init_usb_error;
+
 	return 0;
 init_usb_error:
 	dev_err(&midex->usbdev->dev, SB_MIDEX_PREFIX "usb_alloc_urb failed\n");
 	return -ENOMEM;
 }
 
+static void sb_midex_proc_perf(struct snd_info_buffer *buffer,
+			       const char *name,
+			       const struct sb_midex_perf *perf)
+{
+	u64 count = READ_ONCE(perf->count);
+
+	snd_iprintf(buffer, "%s: %llu calls, avg %llu ns, max %llu ns\n", name,
+		    count,
+		    count ? div64_u64(READ_ONCE(perf->total_ns), count) : 0,
+		    READ_ONCE(perf->max_ns));
+}
+
+static void sb_midex_proc_read(struct snd_info_entry *entry,
+			       struct snd_info_buffer *buffer)
+{
+	static const char *const dispatch_names[SB_MIDEX_NUM_DISPATCH] = {
+		"MIDI output dispatch, direct",
+		"MIDI output dispatch, work",
+		"MIDI output dispatch, thread",
+	};
+	struct sb_midex *midex = entry->private_data;
+	unsigned int queued = 0;
+	int mode;
+	int ep;
+	int i;
+
+	snd_iprintf(buffer,
+		    "Device clock: offset %lld ns, drift %lld ppb, jitter %lld us, %llu samples, %llu windows\n",
+		    READ_ONCE(midex->clock.ref_host_ns) -
+			    (s64)READ_ONCE(midex->clock.ref_device_ns),
+		    READ_ONCE(midex->clock.drift_ppb),
+		    div_s64(READ_ONCE(midex->clock.jitter_ns), NSEC_PER_USEC),
+		    READ_ONCE(midex->clock.samples),
+		    READ_ONCE(midex->clock.windows));
+	sb_midex_proc_perf(buffer, "MIDI input completion",
+			   &midex->midi_in_perf);
+	snd_iprintf(buffer,
+		    "MIDI input: %llu packets, %llu deliveries, %llu overruns\n",
+		    READ_ONCE(midex->midi_in_packets),
+		    READ_ONCE(midex->midi_in_deliveries),
+		    READ_ONCE(midex->midi_in_queue.overruns));
+	snd_iprintf(buffer, "Timer: %s, %llu ticks\n",
+		    READ_ONCE(midex->timer_timing_active) ? "running" : "idle",
+		    READ_ONCE(midex->timer_timing_ticks));
+	snd_iprintf(buffer, "LED transfers: %llu\n",
+		    READ_ONCE(midex->led_transfers));
+	snd_iprintf(buffer, "MIDI output urbs: %u bytes\n",
+		    midex->midi_out_max_len);
+	for (mode = 0; mode < SB_MIDEX_NUM_DISPATCH; mode++) {
+		sb_midex_proc_perf(buffer, dispatch_names[mode],
+				   &midex->midi_out_dispatch_perf[mode]);
+		snd_iprintf(buffer, "  %llu packets sent\n",
+			    READ_ONCE(midex->midi_out_dispatch_packets[mode]));
+	}
+	snd_iprintf(buffer,
+		    "Scheduled output: %u queued, %llu sent, %llu late, "
+		    "%llu dropped\n",
+		    READ_ONCE(midex->sched.len), READ_ONCE(midex->sched.sent),
+		    READ_ONCE(midex->sched.late),
+		    READ_ONCE(midex->sched.dropped));
+	snd_iprintf(buffer,
+		    "MIDI clock: %s, %u.%02u BPM, ports 0x%02x, %llu ticks\n",
+		    READ_ONCE(midex->clock_gen.running) ? "running" : "stopped",
+		    READ_ONCE(midex->clock_gen.tempo) / 100,
+		    READ_ONCE(midex->clock_gen.tempo) % 100,
+		    READ_ONCE(midex->clock_gen.ports),
+		    READ_ONCE(midex->clock_gen.ticks));
+	snd_iprintf(buffer, "MIDI thru: %llu packets\n",
+		    READ_ONCE(midex->midi_thru_packets));
+	for (i = 0; i < ARRAY_SIZE(midex->midi_out_queues); i++)
+		queued += kfifo_len(&midex->midi_out_queues[i].fifo);
+	snd_iprintf(buffer, "MIDI output queue: %u packets, %llu overruns\n",
+		    queued,
+		    READ_ONCE(midex->midi_out_queue_overruns));
+	snd_iprintf(buffer,
+		    "MIDI real-time queue: %u packets, %llu overruns, "
+		    "%llu reserved urbs\n",
+		    kfifo_len(&midex->midi_out_rt_queue),
+		    READ_ONCE(midex->midi_out_rt_overruns),
+		    READ_ONCE(midex->midi_out_rt_urbs));
+	snd_iprintf(buffer,
+		    "MIDI input urbs: depth %u, in flight %d, high-water %u\n",
+		    READ_ONCE(midex->midi_in_pool.depth),
+		    atomic_read(&midex->midi_in_pool.in_flight),
+		    READ_ONCE(midex->midi_in_pool.high_water));
+	for (ep = 0; ep < SB_MIDEX_NUM_EPS; ep++)
+		snd_iprintf(buffer,
+			    "URB %s: max age %llu us, %llu stalls, %llu recoveries\n",
+			    sb_midex_urb_ep_names[ep],
+			    div_u64(READ_ONCE(midex->urb_health[ep].max_age_ns),
+				    NSEC_PER_USEC),
+			    READ_ONCE(midex->urb_health[ep].stalls),
+			    READ_ONCE(midex->urb_health[ep].recoveries));
+	snd_iprintf(buffer, "URB empty transfers refused: %llu\n",
+		    READ_ONCE(midex->urb_empty_refused));
+}
+
+/**
+ * Adds /proc/asound/cardX/midex with the driver's run time state
+ */
+static int sb_midex_init_proc(struct sb_midex *midex)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+	return snd_card_ro_proc_new(midex->card, "midex", midex,
+				    sb_midex_proc_read);
+#else
+	struct snd_info_entry *entry;
+	int err = snd_card_proc_new(midex->card, "midex", &entry);
+
+	if (err < 0)
+		return err;
+	snd_info_set_text_ops(entry, midex, sb_midex_proc_read);
+	return 0;
+#endif
+}
+
 /**
- * Get the input/output substreams and store them in our ports list.
- * Also set the substream name
+ * Set the input/output substream names. The ports get their substreams
+ * when they are opened.
  */
 static void sb_midex_init_rawmidi_substreams(struct sb_midex *midex)
 {
@@ -1285,7 +5073,6 @@ static void sb_midex_init_rawmidi_substreams(struct sb_midex *midex)
 		substream,
 		&midex->rmidi->streams[SNDRV_RAWMIDI_STREAM_OUTPUT].substreams,
 		list) {
-		midex->midi_out.ports[substream->number].substream = substream;
 		snprintf(substream->name, sizeof(substream->name),
 			 "MIDEX Port %d", substream->number + 1);
 	}
@@ -1294,7 +5081,6 @@ static void sb_midex_init_rawmidi_substreams(struct sb_midex *midex)
 		substream,
 		&midex->rmidi->streams[SNDRV_RAWMIDI_STREAM_INPUT].substreams,
 		list) {
-		midex->midi_in.ports[substream->number].substream = substream;
 		snprintf(substream->name, sizeof(substream->name),
 			 "MIDEX Port %d", substream->number + 1);
 	}
@@ -1392,7 +5178,7 @@ static void sb_midex_init_determine_type_and_name(struct sb_midex *midex)
 static void sb_midex_init_midex_urb(struct sb_midex *midex,
 				    struct sb_midex_urb_ctx *urbctx)
 {
-	urbctx->active = false;
+	urbctx->submitted = 0;
 	urbctx->urb = NULL;
 	urbctx->midex = midex;
 }
@@ -1412,8 +5198,12 @@ sb_midex_init_midex_data_struct(struct usb_interface *interface,
 
 	midex->num_used_substreams = 0;
 	midex->timing_state = SB_MIDEX_TIMING_IDLE;
+	sb_midex_clock_reset(&midex->clock);
+	atomic_set(&midex->clock_restart, 0);
 
 	midex->led_state = SB_MIDEX_LED_INIT; /* start state */
+	midex->led_runs = 0;
+	atomic_set(&midex->led_activity, 0);
 	midex->led_state_gfx = 0;
 
 	midex->midi_in.active = false;
@@ -1423,58 +5213,196 @@ sb_midex_init_midex_data_struct(struct usb_interface *interface,
 	spin_lock_init(&(midex->midi_in.lock));
 	spin_lock_init(&(midex->timer_timing_lock));
 
-	tasklet_init(&midex->midi_out_tasklet, sb_midex_usb_midi_output_tasklet,
-		     (unsigned long)midex);
+	INIT_WORK(&midex->midi_out_work, sb_midex_usb_midi_output_work);
+	kthread_init_work(&midex->midi_out_kthread_work,
+			  sb_midex_usb_midi_output_kthread_work);
+	midex->midi_out_worker = NULL;
+	INIT_WORK(&midex->midi_out_thread_start,
+		  sb_midex_usb_midi_output_thread_start_work);
+	midex->midi_out_thread_failed = false;
+	midex->midi_out_kick_time = 0;
+	/* set up here, the probe error path cancels it before it ever ran */
+	midex->timer_timing_active = false;
+	midex->timer_timing_gone = true;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&midex->timer_timing, sb_midex_timer_timing_callback,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	hrtimer_setup(&midex->midi_out_pace_timer,
+		      sb_midex_usb_midi_output_pace_callback, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_ABS);
+	hrtimer_setup(&midex->sched.timer, sb_midex_sched_callback,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	hrtimer_setup(&midex->clock_gen.timer, sb_midex_clock_gen_callback,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	hrtimer_setup(&midex->urb_monitor, sb_midex_urb_monitor_callback,
+		      CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&midex->timer_timing, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	midex->timer_timing.function = sb_midex_timer_timing_callback;
+	hrtimer_init(&midex->midi_out_pace_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_ABS);
+	midex->midi_out_pace_timer.function =
+		sb_midex_usb_midi_output_pace_callback;
+	hrtimer_init(&midex->sched.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	midex->sched.timer.function = sb_midex_sched_callback;
+	hrtimer_init(&midex->clock_gen.timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_ABS);
+	midex->clock_gen.timer.function = sb_midex_clock_gen_callback;
+	hrtimer_init(&midex->urb_monitor, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	midex->urb_monitor.function = sb_midex_urb_monitor_callback;
+#endif
+	midex->midi_out_seq = 0;
+	midex->midi_out_first_port = 0;
+	midex->midi_out_recovering = false;
+	midex->urb_flags = 0;
+	midex->urb_stalled = 0;
+	midex->urb_stuck = 0;
+	midex->urb_recovering = 0;
+	midex->urb_empty_refused = 0;
+	for (i = 0; i < SB_MIDEX_NUM_DMA_ARENAS; i++)
+		midex->dma_arenas[i].buffer = NULL;
+	INIT_WORK(&midex->urb_recover_work, sb_midex_urb_recover_work);
+	midex->clock_gen.tempo = SB_MIDEX_CLOCK_GEN_TEMPO_DEFAULT;
+	midex->clock_gen.ports = 0;
+	midex->clock_gen.running = false;
+	spin_lock_init(&midex->sched.lock);
+	midex->sched.len = 0;
+	midex->sched.seq = 0;
+
+	INIT_WORK(&midex->midi_in_queue.work, sb_midex_usb_midi_input_work);
+	for (i = 0; i < ARRAY_SIZE(midex->midi_out_queues); i++)
+		INIT_KFIFO(midex->midi_out_queues[i].fifo);
+	INIT_KFIFO(midex->midi_out_rt_queue);
+#if IS_ENABLED(CONFIG_SND_SEQUENCER)
+	midex->seq.client = -1;
+#endif
 
 	init_waitqueue_head(&midex->drain_wait);
-	midex->drain_urbs = 0;
+	midex->midi_thru_inputs = 0;
 
 	/* clear ports mem */
 	for (i = 0; i < 8; ++i) {
 		midex->midi_in.ports[i].substream = NULL;
 		midex->midi_in.ports[i].triggered = 0;
 		midex->midi_in.ports[i].state = STATE_UNKNOWN;
+		midex->midi_in.ports[i].tstamp = 0;
+		midex->midi_in.ports[i].batch = &midex->midi_in_batch[i];
+		midex->midi_in_batch[i].len = 0;
+		midex->midi_in.ports[i].thru = 0;
 
 		midex->midi_out.ports[i].substream = NULL;
 		midex->midi_out.ports[i].triggered = 0;
 		midex->midi_out.ports[i].state = STATE_UNKNOWN;
+		midex->midi_out.ports[i].sent = 0;
+		midex->midi_out.ports[i].batch = NULL;
 	}
 
 	/* clear urb ctx mem */
+	midex->midi_in.urbs = midex->midi_in_urbs;
+	midex->midi_out.urbs = midex->midi_out_urbs;
 	sb_midex_init_midex_urb(midex, &midex->led_replies_urb);
 
 	for (i = 0; i < SB_MIDEX_NUM_URBS_PER_EP; ++i) {
 		sb_midex_init_midex_urb(midex, &midex->led_commands_urb[i]);
 		sb_midex_init_midex_urb(midex, &midex->timing_out_urb[i]);
-		sb_midex_init_midex_urb(midex, &midex->midi_in.urbs[i]);
 		sb_midex_init_midex_urb(midex, &midex->midi_out.urbs[i]);
 	}
+	sb_midex_init_midex_urb(midex,
+				&midex->midi_out.urbs[SB_MIDEX_OUT_RT_URB]);
+
+	for (i = 0; i < SB_MIDEX_NUM_IN_URBS_MAX; ++i)
+		sb_midex_init_midex_urb(midex, &midex->midi_in.urbs[i]);
+
+	midex->midi_in_pool.depth = SB_MIDEX_NUM_IN_URBS_MIN;
+	midex->midi_in_pool.high_water = SB_MIDEX_NUM_IN_URBS_MIN;
+	atomic_set(&midex->midi_in_pool.in_flight, 0);
+
+	/* EP2 in urbs wait for input, the EP6 in one for a reply */
+	sb_midex_init_urb_health(midex, SB_MIDEX_EP_TIMING_OUT,
+				 midex->timing_out_urb,
+				 SB_MIDEX_NUM_URBS_PER_EP,
+				 SB_MIDEX_URB_STUCK_NS);
+	sb_midex_init_urb_health(midex, SB_MIDEX_EP_MIDI_IN,
+				 midex->midi_in.urbs,
+				 SB_MIDEX_NUM_IN_URBS_MAX, 0);
+	/* without pacing, the device holds output back while it is busy */
+	sb_midex_init_urb_health(midex, SB_MIDEX_EP_MIDI_OUT,
+				 midex->midi_out.urbs, SB_MIDEX_OUT_RT_URB + 1,
+				 output_pacing ? SB_MIDEX_URB_STUCK_OUT_NS : 0);
+	sb_midex_init_urb_health(midex, SB_MIDEX_EP_LED_OUT,
+				 midex->led_commands_urb,
+				 SB_MIDEX_NUM_URBS_PER_EP,
+				 SB_MIDEX_URB_STUCK_NS);
+	sb_midex_init_urb_health(midex, SB_MIDEX_EP_LED_IN,
+				 &midex->led_replies_urb, 1, 0);
 
 	return midex;
 }
 
+/**
+ * Starts the realtime output thread, if output_dispatch is 2 at probe time.
+ * Otherwise the first kick with output_dispatch 2 starts it.
+ */
+static int sb_midex_init_dispatch(struct sb_midex *midex)
+{
+	if (READ_ONCE(output_dispatch) == SB_MIDEX_DISPATCH_THREAD)
+		sb_midex_usb_midi_output_thread_start(midex);
+	return 0;
+}
+
+static void sb_midex_free_dispatch(struct sb_midex *midex)
+{
+	cancel_work_sync(&midex->midi_out_thread_start);
+	cancel_work_sync(&midex->midi_out_work);
+	if (midex->midi_out_worker)
+		kthread_destroy_worker(midex->midi_out_worker);
+	midex->midi_out_worker = NULL;
+}
+
+/*
+ * Only needed when the probe fails: the device is still connected, and the
+ * urbs submitted by sb_midex_init_device() would complete into freed buffers.
+ */
+static void sb_midex_kill_urbs(struct sb_midex *midex)
+{
+	int urb_index;
+
+	usb_kill_urb(midex->led_replies_urb.urb);
+
+	for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP; ++urb_index) {
+		usb_kill_urb(midex->led_commands_urb[urb_index].urb);
+		usb_kill_urb(midex->timing_out_urb[urb_index].urb);
+	}
+
+	for (urb_index = 0; urb_index <= SB_MIDEX_OUT_RT_URB; ++urb_index)
+		usb_kill_urb(midex->midi_out.urbs[urb_index].urb);
+
+	for (urb_index = 0; urb_index < SB_MIDEX_NUM_IN_URBS_MAX; ++urb_index)
+		usb_kill_urb(midex->midi_in.urbs[urb_index].urb);
+}
+
 static void sb_midex_free_usb_related_resources(struct sb_midex *midex,
 						struct usb_interface *interface)
 {
 	int urb_index;
 	/* usb_kill_urb not necessary, urb is aborted automatically */
 
-	sb_midex_urb_and_buffer_free(midex, midex->led_replies_urb.urb, 8);
+	usb_free_urb(midex->led_replies_urb.urb);
 
 	for (urb_index = 0; urb_index < SB_MIDEX_NUM_URBS_PER_EP; ++urb_index) {
-		sb_midex_urb_and_buffer_free(
-			midex, midex->led_commands_urb[urb_index].urb, 8);
-		sb_midex_urb_and_buffer_free(
-			midex, midex->timing_out_urb[urb_index].urb,
-			SB_MIDEX_URB_BUFFER_SIZE);
-		sb_midex_urb_and_buffer_free(midex,
-					     midex->midi_in.urbs[urb_index].urb,
-					     SB_MIDEX_URB_BUFFER_SIZE);
-		sb_midex_urb_and_buffer_free(
-			midex, midex->midi_out.urbs[urb_index].urb,
-			SB_MIDEX_URB_BUFFER_SIZE);
+		usb_free_urb(midex->led_commands_urb[urb_index].urb);
+		usb_free_urb(midex->timing_out_urb[urb_index].urb);
 	}
 
+	for (urb_index = 0; urb_index <= SB_MIDEX_OUT_RT_URB; ++urb_index)
+		usb_free_urb(midex->midi_out.urbs[urb_index].urb);
+
+	for (urb_index = 0; urb_index < SB_MIDEX_NUM_IN_URBS_MAX; ++urb_index)
+		usb_free_urb(midex->midi_in.urbs[urb_index].urb);
+
+	/* then their buffers */
+	sb_midex_dma_arena_free(midex);
+
 	if (midex->intf) {
 		usb_set_intfdata(midex->intf, NULL);
 		midex->intf = NULL;
@@ -1646,6 +5574,26 @@ static int sb_midex_init_driver(struct sb_midex *midex)
 	if (ret < 0)
 		return ret;
 
+	ret = sb_midex_init_ump(midex);
+	if (ret < 0)
+		return ret;
+
+	ret = sb_midex_init_controls(midex);
+	if (ret < 0)
+		return ret;
+
+	ret = sb_midex_init_hwdep(midex);
+	if (ret < 0)
+		return ret;
+
+	ret = sb_midex_init_dispatch(midex);
+	if (ret < 0)
+		return ret;
+
+	ret = sb_midex_init_proc(midex);
+	if (ret < 0)
+		return ret;
+
 	ret = sb_midex_init_usb(midex);
 	if (ret < 0)
 		return ret;
@@ -1654,6 +5602,10 @@ static int sb_midex_init_driver(struct sb_midex *midex)
 	if (ret < 0)
 		return ret;
 
+	ret = sb_midex_init_seq(midex);
+	if (ret < 0)
+		return ret;
+
 	return 0;
 }
 
@@ -1723,8 +5675,23 @@ static int sb_midex_drv_probe(struct usb_interface *interface,
 	return 0;
 
 probe_error:
-	dev_info(&midex->usbdev->dev, SB_MIDEX_PREFIX "error during probing");
-	sb_midex_free_usb_related_resources(midex, interface);
+	dev_info(&interface->dev, SB_MIDEX_PREFIX "error during probing");
+	if (midex) {
+		sb_midex_free_seq(midex);
+		spin_lock_irq(&midex->timer_timing_lock);
+		midex->timer_timing_gone = true;
+		spin_unlock_irq(&midex->timer_timing_lock);
+		sb_midex_urb_monitor_stop(midex);
+		hrtimer_cancel(&midex->timer_timing);
+		hrtimer_cancel(&midex->clock_gen.timer);
+		hrtimer_cancel(&midex->sched.timer);
+		hrtimer_cancel(&midex->midi_out_pace_timer);
+		cancel_work_sync(&midex->midi_in_queue.work);
+		/* the output work uses the urbs */
+		sb_midex_free_dispatch(midex);
+		sb_midex_kill_urbs(midex);
+		sb_midex_free_usb_related_resources(midex, interface);
+	}
 	snd_card_free(card);
 	mutex_unlock(&devices_mutex);
 	return err;
@@ -1733,28 +5700,44 @@ probe_error:
 static void sb_midex_drv_disconnect(struct usb_interface *interface)
 {
 	struct sb_midex *midex = usb_get_intfdata(interface);
+	int i;
 
 	if (!midex)
 		return;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
-	timer_delete_sync(&(midex->timer_led));
-#else
-	del_timer_sync(&(midex->timer_led));
-#endif
-	hrtimer_cancel(&(midex->timer_timing));
-	tasklet_kill(&(midex->midi_out_tasklet));
+	/* no new events from the sequencer */
+	sb_midex_free_seq(midex);
 
-	if (midex->drain_urbs) {
-		midex->drain_urbs = 0;
-		wake_up(&midex->drain_wait);
-	}
+	/* an open or control put until snd_card_disconnect() may not rearm */
+	spin_lock_irq(&midex->timer_timing_lock);
+	midex->timer_timing_gone = true;
+	spin_unlock_irq(&midex->timer_timing_lock);
+	/* also stops kicking the output, and with it the pacing timer */
+	sb_midex_urb_monitor_stop(midex);
+
+	/* release drain waiters, the urbs will not complete anymore */
+	spin_lock_irq(&midex->midi_out.lock);
+	for (i = 0; i < 8; ++i)
+		midex->midi_out.ports[i].urbs_in_flight = 0;
+	spin_unlock_irq(&midex->midi_out.lock);
+	wake_up(&midex->drain_wait);
 
 	mutex_lock(&devices_mutex);
 
 	/* make sure that userspace cannot create new requests */
 	snd_card_disconnect(midex->card);
 
+	/*
+	 * Then the output sources (the clock generator runs until its control
+	 * is gone), the pacing timer they arm through the output, and the
+	 * output work and thread, before their urbs go.
+	 */
+	hrtimer_cancel(&midex->timer_timing);
+	hrtimer_cancel(&midex->clock_gen.timer);
+	hrtimer_cancel(&midex->sched.timer);
+	hrtimer_cancel(&midex->midi_out_pace_timer);
+	cancel_work_sync(&midex->midi_in_queue.work);
+	sb_midex_free_dispatch(midex);
 	sb_midex_free_usb_related_resources(midex, interface);
 
 	clear_bit(midex->card_index, devices_used);
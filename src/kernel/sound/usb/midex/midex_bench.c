@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-2.0+
+/*
+ * Steinberg Midex 8 driver: MIDI output encoder benchmark
+ *
+ * Only built with -DSB_MIDEX_ENCODER_BENCH (see the Makefile). It is
+ * included by midex.c, after the encoder it measures, as it uses the
+ * driver's structures and static functions.
+ */
+
+/*
+ * The switch based encoder the table replaced, as the benchmark reference.
+ * \note (Same the ALSA USB MIDI driver's snd_usbmidi_transmit_byte)
+ */
+static void sb_midex_encoder_bench_ref_byte(struct sb_midex *midex,
+					    struct sb_midex_port *port,
+					    uint8_t cable, uint8_t b,
+					    struct urb *urb)
+{
+	uint8_t p0 = cable << 4;
+
+	if (b >= 0xf8) {
+		sb_midex_usb_midi_output_queue_rt(midex, cable, b);
+	} else if (b >= 0xf0) {
+		switch (b) {
+		case 0xf0:
+			port->midi_data[0] = b;
+			port->state = STATE_SYSEX_1;
+			break;
+		case 0xf1:
+		case 0xf3:
+			port->midi_data[0] = b;
+			port->state = STATE_1PARAM;
+			break;
+		case 0xf2:
+			port->midi_data[0] = b;
+			port->state = STATE_2PARAM_1;
+			break;
+		case 0xf4:
+		case 0xf5:
+			port->state = STATE_UNKNOWN;
+			break;
+		case 0xf6:
+			sb_midex_usb_midi_output_packet(urb, p0 | 0x05, 0xf6, 0,
+							0);
+			port->state = STATE_UNKNOWN;
+			break;
+		case 0xf7:
+			switch (port->state) {
+			case STATE_SYSEX_0:
+				sb_midex_usb_midi_output_packet(urb, p0 | 0x05,
+								0xf7, 0, 0);
+				break;
+			case STATE_SYSEX_1:
+				sb_midex_usb_midi_output_packet(
+					urb, p0 | 0x06, port->midi_data[0],
+					0xf7, 0);
+				break;
+			case STATE_SYSEX_2:
+				sb_midex_usb_midi_output_packet(
+					urb, p0 | 0x07, port->midi_data[0],
+					port->midi_data[1], 0xf7);
+				break;
+			default:
+				break;
+			}
+			port->state = STATE_UNKNOWN;
+			break;
+		}
+	} else if (b >= 0x80) {
+		port->midi_data[0] = b;
+		if (b >= 0xc0 && b <= 0xdf)
+			port->state = STATE_1PARAM;
+		else
+			port->state = STATE_2PARAM_1;
+	} else { /* b < 0x80 */
+		switch (port->state) {
+		case STATE_1PARAM:
+			if (port->midi_data[0] < 0xf0) {
+				p0 |= port->midi_data[0] >> 4;
+			} else {
+				p0 |= 0x02;
+				port->state = STATE_UNKNOWN;
+			}
+			sb_midex_usb_midi_output_packet(
+				urb, p0, port->midi_data[0], b, 0);
+			break;
+		case STATE_2PARAM_1:
+			port->midi_data[1] = b;
+			port->state = STATE_2PARAM_2;
+			break;
+		case STATE_2PARAM_2:
+			if (port->midi_data[0] < 0xf0) {
+				p0 |= port->midi_data[0] >> 4;
+				port->state = STATE_2PARAM_1;
+			} else {
+				p0 |= 0x03;
+				port->state = STATE_UNKNOWN;
+			}
+			sb_midex_usb_midi_output_packet(urb, p0,
+							port->midi_data[0],
+							port->midi_data[1], b);
+			break;
+		case STATE_SYSEX_0:
+			port->midi_data[0] = b;
+			port->state = STATE_SYSEX_1;
+			break;
+		case STATE_SYSEX_1:
+			port->midi_data[1] = b;
+			port->state = STATE_SYSEX_2;
+			break;
+		case STATE_SYSEX_2:
+			sb_midex_usb_midi_output_packet(urb, p0 | 0x04,
+							port->midi_data[0],
+							port->midi_data[1], b);
+			port->state = STATE_SYSEX_0;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static int sb_midex_encoder_bench_ref(struct sb_midex *midex,
+				      struct sb_midex_port *port,
+				      uint8_t cable, const uint8_t *buf,
+				      int count, struct urb *urb,
+				      unsigned int max_len)
+{
+	int i = 0;
+
+	while (i < count && urb->transfer_buffer_length + 4 <= max_len) {
+		if (port->state == STATE_SYSEX_0 && i + 3 <= count &&
+		    !((buf[i] | buf[i + 1] | buf[i + 2]) & 0x80)) {
+			sb_midex_usb_midi_output_packet(urb, (cable << 4) | 0x04,
+							buf[i], buf[i + 1],
+							buf[i + 2]);
+			i += 3;
+			continue;
+		}
+
+		sb_midex_encoder_bench_ref_byte(midex, port, cable, buf[i++],
+						urb);
+	}
+
+	return i;
+}
+
+typedef int (*sb_midex_encoder_bench_fn)(struct sb_midex *,
+					 struct sb_midex_port *, uint8_t,
+					 const uint8_t *, int, struct urb *,
+					 unsigned int);
+
+/* Returns the bytes per second of the encoder over the MIDI bytes */
+static u64 sb_midex_encoder_bench_run(struct sb_midex *midex,
+				      struct urb *urb,
+				      sb_midex_encoder_bench_fn encode,
+				      const uint8_t *buf, int len)
+{
+	struct sb_midex_port port = { .state = STATE_UNKNOWN };
+	ktime_t start = ktime_get();
+	u64 ns;
+	int rep;
+	int i;
+
+	for (rep = 0; rep < 1000; rep++) {
+		for (i = 0; i < len;) {
+			urb->transfer_buffer_length = 0;
+			i += encode(midex, &port, 0, buf + i, len - i, urb,
+				    SB_MIDEX_URB_BUFFER_SIZE);
+		}
+	}
+
+	ns = max_t(u64, ktime_to_ns(ktime_sub(ktime_get(), start)), 1);
+	return div64_u64((u64)len * rep * NSEC_PER_SEC, ns);
+}
+
+/*
+ * Benchmarks the table encoder against the switch based one, for notes
+ * (full status), controllers (running status) and SysEx, into the kernel log.
+ */
+static void sb_midex_encoder_bench(void)
+{
+	static const char *const mix_names[] = { "note", "CC", "SysEx" };
+	uint8_t urb_buf[SB_MIDEX_URB_BUFFER_SIZE];
+	struct sb_midex *midex;
+	struct urb *urb;
+	uint8_t *mixes;
+	int len = 1023; /* divisible by 3 */
+	int mix;
+	int i;
+
+	midex = kzalloc(sizeof(*midex), GFP_KERNEL);
+	urb = usb_alloc_urb(0, GFP_KERNEL);
+	mixes = kmalloc_array(ARRAY_SIZE(mix_names), len, GFP_KERNEL);
+	if (!midex || !urb || !mixes)
+		goto out;
+
+	INIT_KFIFO(midex->midi_out_rt_queue);
+	urb->transfer_buffer = urb_buf;
+
+	for (i = 0; i < len; i += 3) {
+		/* note on/off, on all channels */
+		mixes[i] = ((i & 0x3) ? 0x90 : 0x80) | ((i / 3) & 0x0f);
+		mixes[i + 1] = (i / 3) & 0x7f;
+		mixes[i + 2] = 0x40;
+		/* controller changes, running status */
+		mixes[len + i] = (i & 0x7f) / 3;
+		mixes[len + i + 1] = i & 0x7f;
+		mixes[len + i + 2] = (i + 1) & 0x7f;
+		/* SysEx data */
+		mixes[2 * len + i] = i & 0x7f;
+		mixes[2 * len + i + 1] = (i + 1) & 0x7f;
+		mixes[2 * len + i + 2] = (i + 2) & 0x7f;
+	}
+	mixes[len] = 0xb0;
+	mixes[2 * len] = 0xf0;
+	mixes[3 * len - 1] = 0xf7;
+
+	for (mix = 0; mix < ARRAY_SIZE(mix_names); mix++)
+		pr_info(SB_MIDEX_PREFIX
+			"encoder %s: %llu bytes/s table, %llu bytes/s switch\n",
+			mix_names[mix],
+			sb_midex_encoder_bench_run(midex, urb,
+						   sb_midex_usb_midi_output_encode,
+						   &mixes[mix * len], len),
+			sb_midex_encoder_bench_run(midex, urb,
+						   sb_midex_encoder_bench_ref,
+						   &mixes[mix * len], len));
+
+out:
+	kfree(mixes);
+	usb_free_urb(urb);
+	kfree(midex);
+}
+
+static int sb_midex_encoder_bench_set(const char *val,
+				      const struct kernel_param *kp)
+{
+	bool run;
+	int ret;
+
+	ret = kstrtobool(val, &run);
+	if (ret)
+		return ret;
+
+	if (run)
+		sb_midex_encoder_bench();
+	return 0;
+}
+
+static const struct kernel_param_ops sb_midex_encoder_bench_ops = {
+	.set = sb_midex_encoder_bench_set,
+};
+module_param_cb(encoder_bench, &sb_midex_encoder_bench_ops, NULL, 0200);
+MODULE_PARM_DESC(encoder_bench,
+		 "Write 1 to benchmark the MIDI output encoder, results in the kernel log.");
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0+ WITH Linux-syscall-note */
+/*
+ * Steinberg Midex driver: hwdep interface
+ *
+ * The hwdep device (/dev/snd/hwCxD0) queues MIDI output with a deadline.
+ * The driver sends each event from a timer at its deadline, so applications
+ * can write ahead of time and sleep.
+ */
+
+#ifndef SB_MIDEX_IOCTL_H
+#define SB_MIDEX_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Events the driver can hold at a time */
+#define SB_MIDEX_SCHED_LEN 256
+
+/*
+ * One scheduled USB MIDI packet: [PC XX XX XX], with P the output port
+ * (0-7), C the code index number and the MIDI bytes, as in doc/analysis.md.
+ * SysEx is sent as a series of packets with CIN 4, ended by CIN 5, 6 or 7.
+ */
+struct sb_midex_sched_event {
+	__s64 deadline_ns; /* CLOCK_MONOTONIC; sent at once when in the past */
+	__u8 packet[4];
+	__u32 reserved;
+};
+
+struct sb_midex_sched_queue {
+	__u64 events; /* pointer to an array of struct sb_midex_sched_event */
+	__u32 count; /* in: events in the array, out: events queued */
+	__u32 free; /* out: events that can still be queued */
+};
+
+/*
+ * Queues events, in any order. Stops at the first invalid event (-EINVAL
+ * if it is the first) or when the queue is full. An event that finds the
+ * output queue of its port full at its deadline is dropped, and counted in
+ * /proc/asound/cardX/midex.
+ */
+#define SB_MIDEX_IOCTL_SCHED_QUEUE \
+	_IOWR('H', 0x60, struct sb_midex_sched_queue)
+/* Drops all queued events that were not sent yet */
+#define SB_MIDEX_IOCTL_SCHED_DROP _IO('H', 0x61)
+
+#endif /* SB_MIDEX_IOCTL_H */
@@ -0,0 +1,128 @@
+/*
+ * bench_ep4.c
+ *
+ * EP4 output payload benchmark.
+ *
+ * Sends one long SysEx message on a port, with transfers of the full
+ * wMaxPacketSize of EP4 (or the given size), and checks that everything
+ * comes back on EP2 in. Needs a MIDI cable from out to in of that port.
+ * The data bytes count up, so a dropped packet shows as a gap.
+ */
+
+#include "threads.h"
+#include <string.h>
+#include <sys/time.h>
+
+int bench_port = -1;
+
+static volatile long bench_received;
+static volatile long bench_errors;
+static uint8_t bench_expected;
+
+static double now_seconds(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Checks the SysEx data bytes of the bench port in received packets */
+void bench_check_input(uint8_t* buffer, int len) {
+	int i;
+
+	for (; len >= 4; len -= 4, buffer += 4) {
+		uint8_t status = buffer[0] & 0x0f;
+		int num_bytes;
+
+		if ((buffer[0] >> 4) != bench_port)
+			continue;
+
+		switch (status) {
+		case 0x04: num_bytes = 3; break;
+		case 0x05: num_bytes = 1; break;
+		case 0x06: num_bytes = 2; break;
+		case 0x07: num_bytes = 3; break;
+		default: continue;
+		}
+
+		for (i = 1; i <= num_bytes; i++) {
+			uint8_t b = buffer[i];
+
+			if (b == 0xf0 || b == 0xf7)
+				continue;
+			if (b != bench_expected) {
+				bench_errors++;
+				fprintf(stderr, "expected %02X, got %02X (after %ld bytes)\n",
+						bench_expected, b, bench_received);
+			}
+			bench_expected = (b + 1) & 0x7f;
+			bench_received++;
+		}
+	}
+}
+
+void bench_ep4_out(struct libusb_device_handle *devh, int num_transfers, int size) {
+	uint8_t buffer[64];
+	int num_transfered;
+	int num_packets;
+	long sent = 0;
+	uint8_t next = 0;
+	double start, end, wait_end;
+	int t, p, r;
+
+	if (size <= 0)
+		size = libusb_get_max_packet_size(libusb_get_device(devh), 0x04 | LIBUSB_ENDPOINT_OUT);
+	if (size < 4 || size > (int)sizeof(buffer)) {
+		fprintf(stderr, "unusable EP4 payload size %d\n", size);
+		do_exit = 1;
+		return;
+	}
+	num_packets = size / 4;
+
+	printf("Bench EP4 out: port %d, %d transfers of %d bytes\n", bench_port, num_transfers, num_packets * 4);
+
+	start = now_seconds();
+	for (t = 0; t < num_transfers && !do_exit; t++) {
+		for (p = 0; p < num_packets; p++) {
+			uint8_t* packet = &buffer[p * 4];
+
+			packet[0] = (bench_port << 4) | 0x04;
+			if (t == 0 && p == 0) {
+				packet[1] = 0xf0;
+			} else {
+				packet[1] = next; next = (next + 1) & 0x7f;
+				sent++;
+			}
+			packet[2] = next; next = (next + 1) & 0x7f;
+			packet[3] = next; next = (next + 1) & 0x7f;
+			sent += 2;
+		}
+		if (t == num_transfers - 1) {
+			// replace the last packet by the SysEx end
+			uint8_t* packet = &buffer[(num_packets - 1) * 4];
+
+			packet[0] = (bench_port << 4) | 0x05;
+			packet[1] = 0xf7;
+			packet[2] = 0;
+			packet[3] = 0;
+			sent -= (num_packets == 1 && t == 0) ? 2 : 3;
+		}
+
+		r = libusb_interrupt_transfer(devh, 0x04 | LIBUSB_ENDPOINT_OUT, buffer, num_packets * 4, &num_transfered, /*timeout:*/0);
+		check_for_error(r, "Error send IR transfer. %s\n", devh);
+		if (num_transfered != num_packets * 4)
+			fprintf(stderr, "short transfer: %d of %d bytes\n", num_transfered, num_packets * 4);
+	}
+	end = now_seconds();
+
+	// the MIDI cable runs at 3125 bytes/s, give the input time to catch up
+	wait_end = end + 2.0 + sent / 3125.0;
+	while (bench_received < sent && now_seconds() < wait_end && !do_exit)
+		usleep(10 * 1000);
+
+	printf("sent %ld bytes in %.3f s (%.0f bytes/s into EP4)\n", sent, end - start, sent / (end - start));
+	printf("received %ld bytes, %ld errors: %s\n", bench_received, bench_errors,
+			(bench_received == sent && bench_errors == 0) ? "OK" : "DATA LOST");
+
+	do_exit = 1;
+}
@@ -176,10 +176,38 @@ void wait_for_threads() {
 }
 
 
+void usage(const char* name) {
+	fprintf(stderr, "usage: %s                        play notes on port 3 with the keyboard\n", name);
+	fprintf(stderr, "       %s -b PORT [TRANSFERS [SIZE]]  EP4 output benchmark,\n", name);
+	fprintf(stderr, "             needs a cable from MIDI out PORT to MIDI in PORT (0-7).\n");
+	fprintf(stderr, "             SIZE defaults to the wMaxPacketSize of EP4.\n");
+}
+
 int main(int argc, char *argv[])
 {
 	struct libusb_device_handle *devh = NULL;
 	int r = 1;
+	int bench_transfers = 1000;
+	int bench_size = 0;
+
+	if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+		char *end;
+		long port = strtol(argv[2], &end, 10);
+
+		if (end == argv[2] || *end != '\0' || port < 0 || port > 7) {
+			fprintf(stderr, "invalid port %s\n", argv[2]);
+			usage(argv[0]);
+			return 1;
+		}
+		bench_port = (int)port;
+		if (argc >= 4)
+			bench_transfers = atoi(argv[3]);
+		if (argc >= 5)
+			bench_size = atoi(argv[4]);
+	} else if (argc > 1) {
+		usage(argv[0]);
+		return 1;
+	}
 
 	r = libusb_init(NULL);
 	check_for_error(r, "failed to init\n", NULL);
@@ -221,7 +249,10 @@ int main(int argc, char *argv[])
 
 	start_threads(devh);
 
-	thread_ep4_out_midi(devh);
+	if (bench_port >= 0)
+		bench_ep4_out(devh, bench_transfers, bench_size);
+	else
+		thread_ep4_out_midi(devh);
 
 	printf("\nWaiting for threads...\n");
 	wait_for_threads();
@@ -18,7 +18,7 @@
 
 void* thread_ep2_in_midi(void* data) {
 	int r;
-	uint8_t buffer[16];
+	uint8_t buffer[64];
 	int num_transfered;
 	struct libusb_device_handle *devh = (struct libusb_device_handle *) data;
 
@@ -26,13 +26,15 @@ void* thread_ep2_in_midi(void* data) {
 	printf("Thread EP2 in\n");
 
 	while (!do_exit) {
-		memset(buffer, 0, 16);
+		memset(buffer, 0, sizeof(buffer));
 
-		r = libusb_interrupt_transfer(devh, 0x02 | LIBUSB_ENDPOINT_IN, buffer, 16, &num_transfered, /*timeout:*/1000);
+		r = libusb_interrupt_transfer(devh, 0x02 | LIBUSB_ENDPOINT_IN, buffer, sizeof(buffer), &num_transfered, /*timeout:*/1000);
 		if (r != LIBUSB_ERROR_TIMEOUT)
 			check_for_error(r, "Error recv IR transfer. %s\n", devh);
 
-		if (num_transfered > 0)
+		if (num_transfered > 0 && bench_port >= 0)
+			bench_check_input(buffer, num_transfered);
+		else if (num_transfered > 0)
 			print_midex_messages(buffer, num_transfered);
 	}
 
@@ -25,5 +25,10 @@ void check_for_error(int r, const char* msg, struct libusb_device_handle *devh);
 
 void print_midex_messages(uint8_t* buffer, int len);
 
+/* EP4 output benchmark, see bench_ep4.c */
+extern int bench_port;
+void bench_check_input(uint8_t* buffer, int len);
+void bench_ep4_out(struct libusb_device_handle *devh, int num_transfers, int size);
+
 
 #endif /* SRC_POC_THREADS_H_ */